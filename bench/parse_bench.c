@@ -0,0 +1,78 @@
+#include "parse.h"
+
+#include <time.h>
+
+/*
+ * parse_command throughput on generated command lines. Prints one JSON
+ * object per case, collected by run.sh.
+ */
+
+#define BENCH_MIN_TIME 0.5 // Seconds spent on each round
+#define BENCH_ROUNDS 3     // The best round is reported
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Appends `count` words to a line: name --option-N=valueN ...  */
+static size_t add_stage(char *line, size_t n, const char *name, int count) {
+  int i;
+
+  n += sprintf(line + n, "%s", name);
+  for (i = 0; i < count; i++)
+    n += sprintf(line + n, " --option-%d=value%d", i, i);
+  return n;
+}
+
+static void bench(const char *name, char *line) {
+  double best = 0, start, elapsed;
+  long ops;
+  int round;
+
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    ops = 0;
+    start = now();
+    do {
+      job *j = parse_command(line);
+      if (!j) {
+        fprintf(stderr, "parse_bench: %s: parse error\n", name);
+        exit(1);
+      }
+      free_job(j);
+      ops++;
+    } while ((elapsed = now() - start) < BENCH_MIN_TIME);
+    if (ops / elapsed > best)
+      best = ops / elapsed;
+  }
+  printf("{\"name\": \"parse_%s\", \"bytes\": %zu, \"ops_per_sec\": %.0f, "
+         "\"mb_per_sec\": %.1f}\n",
+         name, strlen(line), best, best * strlen(line) / 1e6);
+}
+
+int main() {
+  static char line[1 << 20];
+  size_t n;
+  int i;
+
+  strcpy(line, "ls -l /tmp");
+  bench("short", line);
+
+  n = add_stage(line, 0, "cmd", 2000);
+  bench("long_args", line);
+
+  for (n = 0, i = 0; i < 8; i++) {
+    if (i)
+      n += sprintf(line + n, " | ");
+    n = add_stage(line, n, "stage", 40);
+  }
+  bench("pipeline", line);
+
+  for (n = 0, i = 0; i < 200; i++)
+    n += sprintf(line + n, "'single %d' \"double \\\"%d\\\"\" esc\\ aped ", i, i);
+  sprintf(line + n, "< /dev/null > /dev/null 2>> /dev/null");
+  bench("quoted", line);
+  return 0;
+}
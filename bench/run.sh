@@ -0,0 +1,172 @@
+#!/bin/sh
+# Benchmarks of the shell, run by `make bench`.
+#
+#   bench/run.sh <shell> <objdir> <output.json>
+#
+# Every measure is repeated BENCH_REPEAT times (3 by default) and the best
+# run is kept. Sizes can be changed through the environment, see below.
+# Copies run with a warm page cache: compare results from the same machine.
+
+set -e
+
+SHELL_BIN=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+OBJDIR=$2
+OUTPUT=$3
+
+REPEAT=${BENCH_REPEAT:-3}
+LAUNCHES=${BENCH_LAUNCHES:-2000}     # external commands per launch run
+BUILTINS=${BENCH_BUILTINS:-20000}    # builtin commands per run
+PIPE_MB=${BENCH_PIPE_MB:-512}        # data pushed through the pipeline
+PIPE_STAGES=${BENCH_PIPE_STAGES:-4}  # cat stages of the pipeline
+LARGE_MB=${BENCH_LARGE_MB:-256}      # size of the large file copied
+SMALL_FILES=${BENCH_SMALL_FILES:-2000}
+SMALL_KB=${BENCH_SMALL_KB:-4}
+SPARSE_MB=${BENCH_SPARSE_MB:-1024}   # apparent size of the sparse file
+SPARSE_DATA=${BENCH_SPARSE_DATA:-16} # 1 MiB extents of data in it
+GLOB_FILES=${BENCH_GLOB_FILES:-100000} # entries of the globbed directory
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/mael-bench.XXXXXX")
+RESULTS=$WORK/results
+trap 'rm -rf "$WORK"' EXIT
+: >"$RESULTS"
+
+now() { date +%s%N; }
+
+# best <command...>: runs the command REPEAT times, prints the best time in
+# nanoseconds. A `reset` function, if defined, runs before each try. A failing
+# command prints its errors and nothing on stdout, so that `result` stops.
+best() {
+  min=
+  i=0
+  while [ "$i" -lt "$REPEAT" ]; do
+    reset
+    start=$(now)
+    if ! "$@" >/dev/null 2>"$WORK/errors"; then
+      echo "bench: failed: $*" >&2
+      cat "$WORK/errors" >&2
+      exit 1
+    fi
+    elapsed=$(($(now) - start))
+    if [ -z "$min" ] || [ "$elapsed" -lt "$min" ]; then
+      min=$elapsed
+    fi
+    i=$((i + 1))
+  done
+  echo "$min"
+}
+reset() { :; }
+
+# result <name> <ns> <unit> <amount>: records amount/second for a case.
+result() {
+  if [ -z "$2" ]; then
+    echo "bench: no time for $1" >&2
+    exit 1
+  fi
+  awk -v name="$1" -v ns="$2" -v unit="$3" -v amount="$4" 'BEGIN {
+    s = ns / 1e9
+    printf "{\"name\": \"%s\", \"seconds\": %.4f, \"%s_per_sec\": %.1f}\n",
+           name, s, unit, amount / s
+  }' >>"$RESULTS"
+  tail -n 1 "$RESULTS"
+}
+
+# Launch: external commands per second, posix_spawn and fork, and builtins.
+i=0
+while [ "$i" -lt "$LAUNCHES" ]; do
+  echo /bin/true
+  i=$((i + 1))
+done >"$WORK/launch.sh"
+i=0
+while [ "$i" -lt "$BUILTINS" ]; do
+  echo true
+  i=$((i + 1))
+done >"$WORK/builtin.sh"
+
+result launch_spawn "$(best "$SHELL_BIN" "$WORK/launch.sh")" commands \
+  "$LAUNCHES"
+result launch_fork \
+  "$(best env MAEL_SHELL_FORK=1 "$SHELL_BIN" "$WORK/launch.sh")" commands \
+  "$LAUNCHES"
+result launch_builtin "$(best "$SHELL_BIN" "$WORK/builtin.sh")" commands \
+  "$BUILTINS"
+
+# Pipeline: throughput of head | cat | ... | cat > /dev/null, through
+# /bin/cat and through the splice-based builtin, with default and maximum
+# pipe sizes.
+pipeline() {
+  line="head -c ${PIPE_MB}M /dev/zero"
+  i=0
+  while [ "$i" -lt "$PIPE_STAGES" ]; do
+    line="$line | $1"
+    i=$((i + 1))
+  done
+  echo "$line > /dev/null"
+}
+result "pipeline_${PIPE_STAGES}_stages" \
+  "$(best "$SHELL_BIN" -c "$(pipeline /bin/cat)")" mb "$PIPE_MB"
+result "pipeline_${PIPE_STAGES}_stages_builtin" \
+  "$(best "$SHELL_BIN" -c "$(pipeline cat)")" mb "$PIPE_MB"
+result "pipeline_${PIPE_STAGES}_stages_max_pipes" \
+  "$(best "$SHELL_BIN" -c "pipesize max
+$(pipeline /bin/cat)")" mb "$PIPE_MB"
+result "pipeline_${PIPE_STAGES}_stages_builtin_max_pipes" \
+  "$(best "$SHELL_BIN" -c "pipesize max
+$(pipeline cat)")" mb "$PIPE_MB"
+
+# Parser: ops per second on generated lines.
+"$OBJDIR/parse_bench" | tee -a "$RESULTS"
+
+# Glob: three patterns over one large directory, read once per line.
+mkdir -p "$WORK/glob"
+i=0
+while [ "$i" -lt "$GLOB_FILES" ]; do
+  : >"$WORK/glob/file$i.$((i % 2))"
+  i=$((i + 1))
+done
+result "glob_${GLOB_FILES}_entries" \
+  "$(best "$SHELL_BIN" -c "true $WORK/glob/*.1 $WORK/glob/f*9.0 $WORK/glob/[a-f]ile1*")" \
+  entries "$((3 * GLOB_FILES))"
+rm -rf "$WORK/glob"
+
+# Copies: one large file, a tree of small files and a sparse file.
+mkdir -p "$WORK/src/small"
+head -c "${LARGE_MB}M" /dev/urandom >"$WORK/src/large"
+i=0
+while [ "$i" -lt "$SMALL_FILES" ]; do
+  dir=$WORK/src/small/d$((i % 20))
+  mkdir -p "$dir"
+  head -c "${SMALL_KB}K" /dev/urandom >"$dir/f$i"
+  i=$((i + 1))
+done
+truncate -s "${SPARSE_MB}M" "$WORK/src/sparse"
+i=0
+while [ "$i" -lt "$SPARSE_DATA" ]; do
+  dd if=/dev/urandom of="$WORK/src/sparse" bs=1M count=1 conv=notrunc \
+    seek=$((i * SPARSE_MB / SPARSE_DATA)) 2>/dev/null
+  i=$((i + 1))
+done
+
+reset() { rm -rf "$WORK/dst"; }
+result copy_large_file \
+  "$(best "$SHELL_BIN" -c "cp $WORK/src/large $WORK/dst")" mb "$LARGE_MB"
+result copy_small_files \
+  "$(best "$SHELL_BIN" -c "cp $WORK/src/small $WORK/dst")" files \
+  "$SMALL_FILES"
+result copy_sparse_file \
+  "$(best "$SHELL_BIN" -c "cp $WORK/src/sparse $WORK/dst")" mb "$SPARSE_MB"
+reset() { :; }
+
+# Gather everything with what is needed to compare runs.
+mkdir -p "$(dirname "$OUTPUT")"
+{
+  printf '{\n'
+  printf '  "commit": "%s",\n' "$(git rev-parse HEAD 2>/dev/null || echo unknown)"
+  printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+  printf '  "kernel": "%s",\n' "$(uname -r)"
+  printf '  "cpus": %s,\n' "$(getconf _NPROCESSORS_ONLN)"
+  printf '  "repeat": %s,\n' "$REPEAT"
+  printf '  "results": [\n'
+  sed -e 's/^/    /' -e '$!s/$/,/' "$RESULTS"
+  printf '  ]\n}\n'
+} >"$OUTPUT"
+echo "results written to $OUTPUT"
@@ -0,0 +1,30 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK 4096 // Smallest block requested from malloc
+
+/* A chunk of an arena, the memory handed out follows the header.  */
+typedef struct arena_chunk {
+  struct arena_chunk *next; /* chunk allocated before this one */
+  size_t size;              /* bytes usable after the header */
+  size_t used;              /* bytes already handed out */
+} arena_chunk;
+
+/* Bump allocator: everything is freed at once by arena_destroy.  */
+typedef struct arena {
+  arena_chunk *head; /* chunk currently allocated from */
+} arena;
+
+arena *arena_create(size_t size_hint);
+
+void *arena_alloc(arena *a, size_t size);
+
+void *arena_calloc(arena *a, size_t size);
+
+char *arena_strndup(arena *a, const char *s, size_t n);
+
+void arena_destroy(arena *a);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "terminal.h"
+
+#define BUILTIN_SHELL 1 // Changes the shell itself: alone in foreground only
+#define BUILTIN_FORK 2  // Always runs in a child, even alone in foreground
+
+#define STREAM_CHUNK (1024 * 1024) // Bytes asked to splice/tee at once
+#define STREAM_BUFFER (64 * 1024)  // Buffer of the read/write fallback
+
+typedef int (*builtin_fn)(int argc, char **argv);
+
+typedef struct builtin {
+  const char *name;
+  builtin_fn run;
+  int flags;
+} builtin;
+
+void builtins_init();
+
+const builtin *builtin_find(const char *name);
+
+const builtin *builtin_list(size_t *count);
+
+int builtin_run_job(job *j);
+
+int print_escape(const char *s);
+
+int test_command(int argc, char **argv);
+
+int printf_command(int argc, char **argv);
+
+int cat_command(int argc, char **argv);
+
+int tee_command(int argc, char **argv);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include "terminal.h"
+
+#define COMMAND_INDEX_MIN 1024 // Initial number of names of the index
+
+void completion_init();
+
+size_t command_index_refresh();
+
+#endif
@@ -2,19 +2,144 @@
 #ifndef COPY_H
 #define COPY_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // copy_file_range(), must come before the system headers
+#endif
+
 #include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define BUFFER_SIZE 1024 // Size of a block for reading/writting
-#define _GNU_SOURCE
+#define BUFFER_SIZE (128 * 1024)           // Block of the userspace fallback
+#define INCREMENTAL_BLOCK (64 * 1024)      // Block compared by incremental copies
+#define INCREMENTAL_MIN_SIZE (1024 * 1024) // Smaller files are rewritten
+#define MANIFEST_SUFFIX ".crc32c"           // Default manifest: target + suffix
+
+/* Path taken by the copy engine, from the cheapest to the most expensive. */
+typedef enum {
+  COPY_NONE,            /* nothing to copy (empty file) */
+  COPY_REFLINK,         /* FICLONE: extents shared, no data moved */
+  COPY_FILE_RANGE,      /* copy_file_range: copied inside the kernel */
+  COPY_SENDFILE,        /* sendfile: copied inside the kernel */
+  COPY_READ_WRITE,      /* read()/write() through a userspace buffer */
+  COPY_URING,           /* batched with other small files in io_uring */
+  COPY_SPARSE,          /* data extents only, holes left in the target */
+  COPY_UNCHANGED,       /* incremental: same size and time, skipped */
+  COPY_CHANGED_BLOCKS,  /* incremental: only the blocks that differ */
+  COPY_HARDLINK,        /* another name of a file copied already */
+  COPY_METHOD_COUNT     /* number of methods, for the statistics */
+} copyMethod;
+
+/* How the files of a directory are submitted to the kernel. */
+typedef enum {
+  COPY_BACKEND_SYNC, /* one file after the other, blocking system calls */
+  COPY_BACKEND_URING /* small files batched through io_uring */
+} copyBackend;
+
+/* When the holes of a file are reproduced in the target. */
+typedef enum {
+  COPY_SPARSE_AUTO,  /* for files that have holes */
+  COPY_SPARSE_NEVER, /* never, every zero byte is written */
+  COPY_SPARSE_ALWAYS /* always, blocks of zeros also become holes */
+} copySparseMode;
+
+/* What `cp` prints while and after copying. */
+typedef enum {
+  COPY_REPORT_SUMMARY, /* progress line on a terminal, then a summary */
+  COPY_REPORT_QUIET,   /* errors only */
+  COPY_REPORT_VERBOSE, /* one line per file and directory, then a summary */
+  COPY_REPORT_JSON     /* progress line on a terminal, then a JSON summary */
+} copyReportMode;
+
+/* Counters of a copy, shared by the worker threads. */
+typedef struct copyStats {
+  atomic_llong bytesWritten;
+  atomic_llong bytesSkipped; /* already identical at the target */
+  atomic_long filesSkipped;
+  atomic_long filesVerified; /* read back with the same checksum */
+  atomic_long filesCopied;   /* including the unchanged ones */
+  atomic_long directoriesCopied;
+  atomic_long failures;
+  atomic_long methods[COPY_METHOD_COUNT]; /* files copied by each method */
+  copyReportMode mode;
+  int progress;              /* stderr is a terminal: draw a progress line */
+  long long started;         /* CLOCK_MONOTONIC, in nanoseconds */
+  atomic_llong nextProgress; /* when the progress line may be redrawn */
+  atomic_int progressShown;  /* the line has to be erased before a message */
+} copyStats;
+
+/* CRC32C of every verified file, one "crc  path" line each. */
+typedef struct copyManifest {
+  FILE *file;
+  pthread_mutex_t lock; /* lines come from the worker threads */
+} copyManifest;
+
+/* First name met of a source file that has several names. */
+typedef struct copyLink {
+  struct copyLink *next; /* next entry of the same bucket */
+  dev_t device;
+  ino_t inode;
+  char *target; /* where the first name was copied */
+  int state;    /* being copied, copied or failed */
+} copyLink;
+
+/* Source files with several names, by (st_dev, st_ino). */
+typedef struct copyLinks {
+  copyLink **buckets;
+  size_t bucketCount; /* power of two */
+  size_t count;
+  pthread_mutex_t lock;  /* entries come from the worker threads */
+  pthread_cond_t copied; /* a first name has been copied (or failed) */
+} copyLinks;
+
+/* Options of the `cp` builtin. */
+typedef struct copyOptions {
+  int jobs;            /* worker threads for directory copies, 1 = sequential */
+  copyBackend backend; /* used by sequential directory copies */
+  copySparseMode sparse;
+  int incremental;     /* skip unchanged files, rewrite changed blocks */
+  int verify;          /* checksum the data, then read the target back */
+  copyManifest *manifest; /* may be NULL */
+  copyLinks *links;    /* may be NULL: every name is copied separately */
+  copyStats *stats;    /* may be NULL */
+} copyOptions;
+
+void copyOptionsInit(copyOptions *options);
+
+const char *copyMethodName(copyMethod method);
+
+int copyData(int sourceDescriptor, int targetDescriptor, off_t size,
+             copyMethod *method);
+
+int copyDataHashed(int sourceDescriptor, int targetDescriptor,
+                   uint32_t *crc);
+
+int copySparse(int sourceDescriptor, int targetDescriptor, off_t size,
+               int zeroHoles, size_t blockSize, copyMethod *method);
+
+void copyStatsCount(const copyOptions *options, off_t written, off_t skipped);
+
+int copyFileAt(int sourceDirectory, const char *sourceName,
+               int targetDirectory, const char *targetName, const char *target,
+               const copyOptions *options, copyMethod *method);
+
+int copyFileWithOptions(const char *source, const char *target,
+                        const copyOptions *options, copyMethod *method);
 
 int copyFile(const char *source, const char *target);
 
 int copyDirectory(const char *source, const char *target);
 
+int copyDirectoryWithOptions(const char *source, const char *target,
+                             const copyOptions *options);
+
+int copyCommand(int argc, char **argv);
+
 #endif
@@ -0,0 +1,18 @@
+#ifndef COPY_LINKS_H
+#define COPY_LINKS_H
+
+#include "copy.h"
+
+#define LINK_BUCKETS_MIN 64 // Initial number of buckets of the inode table
+
+int copyLinksInit(copyLinks *links);
+
+void copyLinksDestroy(copyLinks *links);
+
+int copyLinkTarget(copyLinks *links, const struct stat *source,
+                   int targetDirectory, const char *targetName,
+                   const char *target, copyLink **claimed);
+
+void copyLinkDone(copyLinks *links, copyLink *claimed, int result);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef COPY_PARALLEL_H
+#define COPY_PARALLEL_H
+
+#include "copy.h"
+
+#define MAX_COPY_JOBS 256 // Upper bound of worker threads for `cp -j`
+#define FDS_PER_JOB 8     // Open descriptors allowed per worker thread
+
+int copyDirectoryParallel(const char *source, const char *target,
+                          const copyOptions *options);
+
+#endif
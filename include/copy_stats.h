@@ -0,0 +1,18 @@
+#ifndef COPY_STATS_H
+#define COPY_STATS_H
+
+#include "copy.h"
+
+#define PROGRESS_INTERVAL_NS 250000000LL // Progress line redrawn 4 times/s
+
+void copyStatsInit(copyStats *stats, copyReportMode mode);
+
+void copyReportFile(const copyOptions *options, const char *source,
+                    const char *target, copyMethod method, int result);
+
+void copyReportDirectory(const copyOptions *options, const char *source,
+                         const char *target, int result);
+
+void copyStatsSummary(copyStats *stats, const copyOptions *options);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef COPY_URING_H
+#define COPY_URING_H
+
+#include "copy.h"
+
+#define URING_BATCH 64                  // Files submitted together
+#define URING_ENTRIES (2 * URING_BATCH) // Two requests per file and stage
+#define URING_SMALL_FILE (64 * 1024)    // Bigger files are left to copyFile
+
+int uringAvailable(void);
+
+int uringCopyFiles(const char **sources, const char **targets, int count,
+                   const copyOptions *options);
+
+#endif
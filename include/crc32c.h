@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32C_POLYNOMIAL 0x82f63b78 // Castagnoli, reflected
+
+uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t length);
+
+const char *crc32cImplementation(void);
+
+#endif
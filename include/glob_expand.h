@@ -0,0 +1,14 @@
+#ifndef GLOB_EXPAND_H
+#define GLOB_EXPAND_H
+
+#include "arena.h"
+
+#define GLOB_BUFFER (256 * 1024) // Bytes asked to getdents64 at once
+#define GLOB_CACHE_DIRS 16       // Listings kept while a line is parsed
+#define GLOB_RESULTS_MIN 64      // Initial size of the result array
+
+char **glob_expand(arena *a, const char *pattern, size_t *count);
+
+void glob_cache_clear();
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef HISTORY_LOG_H
+#define HISTORY_LOG_H
+
+#include <stddef.h>
+
+#define HISTORY_FILE ".mael_history" // In $HOME, unless $MAEL_HISTFILE is set
+#define HISTORY_LOAD 1000       // Recent entries given to readline at startup
+#define HISTORY_INDEX_MIN 1024  // Initial number of entries of the index
+#define HISTORY_QUERY_MAX 256   // Longest Ctrl-R query
+
+int history_log_open(const char *path);
+
+void history_log_append(const char *line);
+
+long history_log_count();
+
+const char *history_log_entry(long i, size_t *length);
+
+long history_log_search(const char *query, size_t length, long before,
+                        int prefix);
+
+void history_log_bind_keys();
+
+int history_command(int argc, char **argv);
+
+#endif
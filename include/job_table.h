@@ -0,0 +1,25 @@
+#ifndef JOB_TABLE_H
+#define JOB_TABLE_H
+
+#include "terminal.h"
+
+#define JOB_TABLE_MIN 16   // Initial number of job slots
+#define PID_BUCKETS_MIN 64 // Initial number of buckets of the pid index
+
+void job_table_add(job *j);
+
+void job_table_started(job *j);
+
+void job_table_remove(job *j);
+
+job *job_table_find(int id);
+
+process *process_table_find(pid_t pid);
+
+void job_table_notify(job *j);
+
+job *job_table_next_notification();
+
+int job_table_has_notifications();
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef JOB_TIME_H
+#define JOB_TIME_H
+
+#include "terminal.h"
+
+double process_cpu_seconds(process *p);
+
+double job_cpu_seconds(job *j);
+
+void job_print_times(job *j);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stddef.h>
+
+#define LINE_READER_SIZE (64 * 1024) // Bytes read at once, lines can be longer
+
+/* Buffered reader of the commands of a script, a pipe or a -c string.  */
+typedef struct line_reader {
+  int fd;         /* -1 when reading from a string */
+  char *buffer;   /* data read, the lines are cut in place */
+  size_t size;    /* allocated size of buffer */
+  size_t start;   /* beginning of the next line */
+  size_t end;     /* end of the data in buffer */
+  int owned;      /* buffer was allocated by the reader */
+} line_reader;
+
+int line_reader_open(line_reader *r, int fd);
+
+void line_reader_string(line_reader *r, char *string);
+
+char *line_reader_next(line_reader *r);
+
+void line_reader_close(line_reader *r);
+
+#endif
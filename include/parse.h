@@ -2,6 +2,13 @@
 #ifndef PARSE_H
 #define PARSE_H
 #include "terminal.h"
+
+#define ARGS_MIN 64 // Initial size of the word buffer, doubled as needed
+
 job *parse_command(char *input);
 
+job *job_create(const char *command, size_t size_hint);
+
+process *job_add_process(job *j, char **argv, int count);
+
 #endif // !PARSE_H
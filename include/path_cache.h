@@ -0,0 +1,16 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include "terminal.h"
+
+#define PATH_BUCKETS_MIN 64 // Initial number of buckets of the command table
+
+const char *path_lookup(const char *name);
+
+void path_forget(const char *name);
+
+void path_clear();
+
+int hash_command(int argc, char **argv);
+
+#endif
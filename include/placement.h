@@ -0,0 +1,19 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "terminal.h"
+
+#define PLACEMENT_NODES_MAX 64 // NUMA nodes looked up in sysfs
+#define PLACEMENT_LISTS_MAX 16 // Per-stage lists of `placement a:b:...`
+
+void placement_assign(job *j);
+
+void placement_enter(process *p);
+
+void placement_leave(process *p);
+
+int format_cpulist(const cpu_set_t *set, char *buffer, size_t size);
+
+int placement_command(int argc, char **argv);
+
+#endif
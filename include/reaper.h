@@ -0,0 +1,14 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include "terminal.h"
+
+int reaper_init();
+
+void reaper_restore_signals();
+
+void reaper_child_mask(sigset_t *mask);
+
+int reaper_poll(int timeout);
+
+#endif
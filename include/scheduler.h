@@ -0,0 +1,22 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "terminal.h"
+
+extern int scheduler_max_jobs; /* running background jobs, 0 = no limit */
+
+int scheduler_submit(job *j);
+
+void scheduler_release(job *j);
+
+void scheduler_run();
+
+void scheduler_start_foreground(job *j);
+
+int scheduler_pending();
+
+int wait_command(int argc, char **argv);
+
+int maxjobs_command(int argc, char **argv);
+
+#endif
@@ -2,37 +2,55 @@
 #ifndef TERMINAL_H
 #define TERMINAL_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pipe2(), environ, must come before the system headers
+#endif
+
 #include <errno.h>
 #include <stdio.h>
 #define _OPEN_SYS
 #include <ctype.h>
 #include <readline/history.h>
 #include <readline/readline.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
 
 // biblotheque personnel
+#include "arena.h"
 #include "copy.h"
 
 // Structure
 /* A process is a single process.  */
 typedef struct process {
-  struct process *next; /* next process in pipeline */
-  char **argv;          /* for exec */
+  struct process *next;      /* next process in pipeline */
+  struct process *hash_next; /* next process in the same pid bucket */
+  struct job *job;           /* job this process belongs to */
+  char **argv;               /* for exec */
+  char *path;                /* program found in PATH, NULL for builtins */
   pid_t pid;            /* process ID */
   char completed;       /* true if process has completed */
   char stopped;         /* true if process has stopped */
   int status;           /* reported status value */
   int taille;
+  struct rusage usage;  /* resources used, filled when it is reaped */
+  cpu_set_t *cpus;      /* CPUs it was placed on, NULL if not pinned */
 } process;
 
 /* A job is a pipeline of processes.  */
 typedef struct job {
-  struct job *next;          /* next active job */
+  struct job *next;          /* next active job (older) */
+  struct job *prev;          /* previous active job (more recent) */
+  struct job *notify_next;   /* next job waiting to be reported */
+  int id;                    /* job number, stable while the job lives */
+  int remaining;             /* processes not completed yet */
+  char queued;               /* true if waiting to be reported */
   char *command;             /* command line, used for messages */
   process *first_process;    /* list of processes in this job */
   pid_t pgid;                /* process group ID */
@@ -40,6 +58,14 @@ typedef struct job {
   struct termios tmodes;     /* saved terminal modes */
   int stdin, stdout, stderr; /* standard i/o channels */
   int background;            /* is job running in background? */
+  arena *arena;              /* owns the job, its processes and argv */
+  char timed;                /* started with the `time` prefix */
+  struct timespec started;   /* launch time, for the wall clock time */
+  struct timespec finished;  /* when its last process completed */
+  char deferred;             /* background job waiting for a free slot */
+  char holds_slot;           /* counted as a running background job */
+  struct job *deferred_next; /* next job waiting for a slot */
+  char *placement;           /* placement policy it was launched with */
 } job;
 
 // Variable globale
@@ -47,12 +73,16 @@ extern pid_t shell_pgid;
 extern struct termios shell_tmodes;
 extern int shell_terminal;
 extern int shell_is_interactive;
+extern int shell_batch; /* -c, script or piped input: no prompt, no chatter */
+extern int shell_use_spawn; /* launch with posix_spawn when possible */
+extern int last_status;     /* exit status of the last foreground job */
+extern int shell_pipe_size; /* F_SETPIPE_SZ of the pipes, 0 = default */
 /* The active jobs are linked into a list.  This is its head.   */
 extern job *first_job;
 
 void format_job_info(job *j, const char *status);
 
-int mark_process_status(pid_t pid, int status);
+int mark_process_status(pid_t pid, int status, const struct rusage *usage);
 
 int job_is_stopped(job *j);
 
@@ -69,14 +99,26 @@ void init_shell();
 void launch_process(process *p, pid_t pgid, int infile, int outfile,
                     int errfile, int foreground);
 
+void launch_pipeline(job *j, int foreground);
+
 void launch_job(job *j, int foreground);
 
+void update_status();
+
+void do_job_notification();
+
 void check_jobs_status();
 
-void list_jobs();
+void list_jobs(int verbose);
+
+job *find_job_by_number(int job_num);
 
 job *find_job_by_pid(pid_t pid);
 
+void job_close_redirections(job *j);
+
+void free_job(job *j);
+
 void do_fg(char *arg);
 
 void do_bg(char *arg);
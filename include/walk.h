@@ -0,0 +1,48 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <dirent.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define WALK_OPEN_MAX 32   // Directories kept open, the others are reopened
+#define WALK_STACK_MIN 16  // Initial depth of the directory stack
+#define WALK_PATH_MIN 256  // Initial size of the path buffer
+
+#define WALK_FOLLOW 1 // Follow symbolic links, like stat()
+#define WALK_STAT 2   // Fill `stat` for every entry, even when d_type is enough
+
+/* Why a walk callback is called. */
+typedef enum {
+  WALK_FILE,          /* anything that is not a directory */
+  WALK_DIRECTORY,     /* a directory, before its entries */
+  WALK_DIRECTORY_END, /* a directory, after all its entries */
+  WALK_ERROR          /* an entry that can't be read, `error` tells why */
+} walkEvent;
+
+/* What the walk does after a callback. */
+typedef enum {
+  WALK_CONTINUE,
+  WALK_SKIP, /* after WALK_DIRECTORY: don't enter it (no WALK_DIRECTORY_END) */
+  WALK_STOP  /* end the walk now */
+} walkAction;
+
+/* Entry passed to the callback, valid until it returns. */
+typedef struct walkEntry {
+  walkEvent event;
+  const char *path;        /* root + names, for messages */
+  const char *name;        /* name of the entry in `parent` */
+  int parent;              /* directory of the entry, AT_FDCWD for the root */
+  int fd;                  /* the directory itself, -1 for the other events */
+  size_t depth;            /* 0 for the root */
+  unsigned char type;      /* DT_REG, DT_DIR, DT_LNK... */
+  const struct stat *stat; /* NULL when d_type was enough (WALK_FILE only) */
+  int error;               /* errno of a WALK_ERROR */
+} walkEntry;
+
+typedef walkAction (*walkCallback)(const walkEntry *entry, void *context);
+
+int walkTree(const char *root, int flags, walkCallback callback,
+             void *context);
+
+#endif
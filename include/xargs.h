@@ -0,0 +1,12 @@
+#ifndef XARGS_H
+#define XARGS_H
+
+#include "terminal.h"
+
+#define XARGS_HEADROOM 2048     // Bytes of ARG_MAX left unused, like xargs
+#define XARGS_READ (64 * 1024)  // Size of the reads on standard input
+#define XARGS_MAX_JOBS 1024     // Upper bound of -P, also used for -P 0
+
+int xargs_command(int argc, char **argv);
+
+#endif
@@ -0,0 +1,95 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Arena allocator.
+ *
+ * A job and everything parsed out of its command line (processes, argv,
+ * words) have the same lifetime, so they are carved out of one arena and
+ * released together. The arena header lives in its first chunk: with a good
+ * size hint, a whole command costs a single malloc.
+ */
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static size_t align_up(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static arena_chunk *chunk_new(size_t size, arena_chunk *next) {
+  arena_chunk *c;
+
+  if (size < ARENA_CHUNK - align_up(sizeof(arena_chunk)))
+    size = ARENA_CHUNK - align_up(sizeof(arena_chunk));
+  c = malloc(align_up(sizeof(arena_chunk)) + size);
+  if (!c)
+    return NULL;
+  c->next = next;
+  c->size = size;
+  c->used = 0;
+  return c;
+}
+
+/* Creates an arena able to serve `size_hint` bytes without growing.  */
+arena *arena_create(size_t size_hint) {
+  arena_chunk *c = chunk_new(align_up(sizeof(arena)) + size_hint, NULL);
+  arena *a;
+
+  if (!c)
+    return NULL;
+  a = (arena *)((char *)c + align_up(sizeof(arena_chunk)));
+  c->used = align_up(sizeof(arena));
+  a->head = c;
+  return a;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+  arena_chunk *c = a->head;
+
+  size = align_up(size);
+  if (c->size - c->used < size) {
+    /* Grow geometrically so long inputs need few chunks.  */
+    size_t want = c->size * 2 > size ? c->size * 2 : size;
+    c = chunk_new(want, a->head);
+    if (!c)
+      return NULL;
+    a->head = c;
+  }
+
+  void *mem = (char *)c + align_up(sizeof(arena_chunk)) + c->used;
+  c->used += size;
+  return mem;
+}
+
+void *arena_calloc(arena *a, size_t size) {
+  void *mem = arena_alloc(a, size);
+
+  if (mem)
+    memset(mem, 0, size);
+  return mem;
+}
+
+char *arena_strndup(arena *a, const char *s, size_t n) {
+  char *copy = arena_alloc(a, n + 1);
+
+  if (copy) {
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+  }
+  return copy;
+}
+
+/* Frees every chunk. The arena itself lives in the first one.  */
+void arena_destroy(arena *a) {
+  arena_chunk *c, *next;
+
+  if (!a)
+    return;
+  for (c = a->head; c; c = next) {
+    next = c->next;
+    free(c);
+  }
+}
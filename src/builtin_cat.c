@@ -0,0 +1,273 @@
+#include "builtins.h"
+
+#include <sys/sendfile.h>
+
+/*
+ * cat and tee without a round trip through userspace.
+ *
+ * When one side is a pipe, the data is moved with splice(), and tee()
+ * duplicates a pipe into another without consuming it. Regular files go to
+ * anything through sendfile(). read()/write() is only the fallback, e.g. for
+ * a terminal. Options we do not implement exec the real program.
+ */
+
+static int is_pipe(int fd) {
+  struct stat st;
+
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static int is_regular(int fd) {
+  struct stat st;
+
+  return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static int write_all(int fd, const char *buffer, size_t size) {
+  ssize_t n;
+
+  while (size > 0) {
+    n = write(fd, buffer, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buffer += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* read()/write() fallback. Returns 0, or -1 with errno set.  */
+static int copy_buffered(int in, int out) {
+  static char buffer[STREAM_BUFFER];
+  ssize_t n;
+
+  for (;;) {
+    n = read(in, buffer, sizeof(buffer));
+    if (n == 0)
+      return 0;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (write_all(out, buffer, n) < 0)
+      return -1;
+  }
+}
+
+/* Copies `in` to `out` until the end of `in`, in the kernel when the file
+   types allow it. Returns 0, or -1 with errno set.  */
+static int pump(int in, int out) {
+  ssize_t n;
+
+  if (is_pipe(in) || is_pipe(out)) {
+    while ((n = splice(in, NULL, out, NULL, STREAM_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+      if (n > 0)
+        continue;
+      if (errno == EINTR)
+        continue;
+      /* EINVAL: this kind of file does not support splice.  */
+      if (errno == EINVAL)
+        break;
+      return -1;
+    }
+    if (n == 0)
+      return 0;
+  } else if (is_regular(in)) {
+    while ((n = sendfile(out, in, NULL, STREAM_CHUNK)) != 0) {
+      if (n > 0)
+        continue;
+      if (errno == EINTR)
+        continue;
+      if (errno == EINVAL || errno == ENOSYS)
+        break;
+      return -1;
+    }
+    if (n == 0)
+      return 0;
+  }
+  return copy_buffered(in, out);
+}
+
+/* cat [-u] [file ...]  */
+int cat_command(int argc, char **argv) {
+  int i, fd, result = 0, files = 0;
+
+  for (i = 1; i < argc; i++)
+    if (argv[i][0] == '-' && argv[i][1] && strcmp(argv[i], "-u") != 0) {
+      /* Numbering, showing tabs...: the real cat does it.  */
+      execvp("cat", argv);
+      perror("cat");
+      return 126;
+    }
+
+  for (i = 1; i <= argc; i++) {
+    const char *name = i < argc ? argv[i] : "-";
+    if (i < argc && strcmp(argv[i], "-u") == 0)
+      continue;
+    if (i == argc && files)
+      break;
+    files++;
+
+    if (strcmp(name, "-") == 0)
+      fd = STDIN_FILENO;
+    else if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+      fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      result = 1;
+      continue;
+    }
+    if (pump(fd, STDOUT_FILENO) < 0) {
+      fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+      result = 1;
+    }
+    if (fd != STDIN_FILENO)
+      close(fd);
+  }
+  return result;
+}
+
+/* Moves `size` bytes of the input to `file` through a buffer.  */
+static int copy_to_file(int file, ssize_t size) {
+  static char buffer[STREAM_BUFFER];
+  ssize_t n;
+
+  while (size > 0) {
+    n = read(STDIN_FILENO, buffer,
+             size < (ssize_t)sizeof(buffer) ? size : (ssize_t)sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0 || write_all(file, buffer, n) < 0)
+      return -1;
+    size -= n;
+  }
+  return 0;
+}
+
+/* tee with a single file, when both standard descriptors are pipes: the
+   data is duplicated into the output pipe by tee(), then moved to the file.
+   Returns 1 when done, 0 if the caller has to fall back, before any data
+   was consumed, and -1 on error.  */
+static int tee_spliced(int file) {
+  ssize_t n, m;
+  int first = 1;
+
+  for (;;) {
+    n = tee(STDIN_FILENO, STDOUT_FILENO, STREAM_CHUNK, 0);
+    if (n == 0)
+      return 1;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return first && errno == EINVAL ? 0 : -1;
+    }
+    first = 0;
+
+    /* Consume what was duplicated by moving it to the file.  */
+    while (n > 0) {
+      m = splice(STDIN_FILENO, NULL, file, NULL, n, SPLICE_F_MOVE);
+      if (m < 0 && errno == EINTR)
+        continue;
+      if (m <= 0) {
+        /* The data already went downstream: it must reach the file too.  */
+        if (copy_to_file(file, n) < 0)
+          return -1;
+        break;
+      }
+      n -= m;
+    }
+  }
+}
+
+/* Copies the input to the output and to every file that could be opened.  */
+static int tee_buffered(int *files, int count, char **names) {
+  static char buffer[STREAM_BUFFER];
+  int i, result = 0;
+  ssize_t n;
+
+  for (;;) {
+    n = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (n == 0)
+      return result;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("tee: read");
+      return 1;
+    }
+    if (write_all(STDOUT_FILENO, buffer, n) < 0) {
+      perror("tee: write");
+      result = 1;
+    }
+    for (i = 0; i < count; i++)
+      if (files[i] >= 0 && write_all(files[i], buffer, n) < 0) {
+        fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+        close(files[i]);
+        files[i] = -1;
+        result = 1;
+      }
+  }
+}
+
+/* tee [-a] [-i] [file ...]  */
+int tee_command(int argc, char **argv) {
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  int i, count, result = 0, *files;
+
+  for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (strcmp(argv[i], "-a") == 0)
+      flags = (flags & ~O_TRUNC) | O_APPEND;
+    else if (strcmp(argv[i], "-i") == 0)
+      signal(SIGINT, SIG_IGN);
+    else if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    } else {
+      execvp("tee", argv);
+      perror("tee");
+      return 126;
+    }
+  }
+
+  count = argc - i;
+  files = malloc((count + 1) * sizeof(int));
+  if (!files) {
+    perror("tee");
+    return 1;
+  }
+  for (int k = 0; k < count; k++) {
+    files[k] = open(argv[i + k], flags, 0666);
+    if (files[k] < 0) {
+      fprintf(stderr, "tee: %s: %s\n", argv[i + k], strerror(errno));
+      result = 1;
+    }
+  }
+
+  if (count == 0) {
+    /* Nothing to duplicate: this is cat.  */
+    if (pump(STDIN_FILENO, STDOUT_FILENO) < 0) {
+      perror("tee");
+      result = 1;
+    }
+  } else {
+    int spliced = 0;
+    /* splice() can't write to a file opened with O_APPEND.  */
+    if (count == 1 && files[0] >= 0 && !(flags & O_APPEND) &&
+        is_pipe(STDIN_FILENO) && is_pipe(STDOUT_FILENO))
+      spliced = tee_spliced(files[0]);
+    if (spliced < 0) {
+      perror("tee");
+      result = 1;
+    } else if (!spliced && tee_buffered(files, count, argv + i))
+      result = 1;
+  }
+
+  for (int k = 0; k < count; k++)
+    if (files[k] >= 0)
+      close(files[k]);
+  free(files);
+  return result;
+}
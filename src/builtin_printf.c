@@ -0,0 +1,202 @@
+#include "builtins.h"
+
+/*
+ * printf format [argument ...]
+ *
+ * Each conversion is handed to the C printf with a single argument of the
+ * right type. The format is reused as long as arguments remain, missing ones
+ * read as empty strings or zeros, like in sh.
+ */
+
+typedef struct printf_state {
+  char **argv;
+  int argc;
+  int pos;
+  int error;
+} printf_state;
+
+static const char *next_arg(printf_state *st) {
+  return st->pos < st->argc ? st->argv[st->pos++] : NULL;
+}
+
+static long long int_arg(printf_state *st) {
+  const char *arg = next_arg(st);
+  char *end;
+  long long value;
+
+  if (!arg || !*arg)
+    return 0;
+  /* 'c or "c stands for the code of the character.  */
+  if (arg[0] == '\'' || arg[0] == '"')
+    return (unsigned char)arg[1];
+  errno = 0;
+  value = strtoll(arg, &end, 0);
+  if (*end || errno) {
+    fprintf(stderr, "printf: %s: invalid number\n", arg);
+    st->error = 1;
+  }
+  return value;
+}
+
+static double float_arg(printf_state *st) {
+  const char *arg = next_arg(st);
+  char *end;
+  double value;
+
+  if (!arg || !*arg)
+    return 0;
+  value = strtod(arg, &end);
+  if (*end) {
+    fprintf(stderr, "printf: %s: invalid number\n", arg);
+    st->error = 1;
+  }
+  return value;
+}
+
+/* Writes the escape of a format string: unlike echo, octal needs no 0.
+   Returns the characters consumed.  */
+static int format_escape(const char *s) {
+  int value = 0, n = 0;
+
+  if (*s >= '0' && *s <= '7') {
+    while (n < 3 && s[n] >= '0' && s[n] <= '7')
+      value = value * 8 + s[n++] - '0';
+    putchar(value);
+    return n;
+  }
+  if (*s == '"' || *s == '\'') {
+    putchar(*s);
+    return 1;
+  }
+  return print_escape(s);
+}
+
+/* %b: the argument with its escapes expanded. Returns -1 after \c.  */
+static int print_escaped_arg(const char *s) {
+  for (; *s; s++) {
+    int n;
+    if (*s != '\\') {
+      putchar(*s);
+      continue;
+    }
+    n = print_escape(s + 1);
+    if (n < 0)
+      return -1;
+    s += n;
+  }
+  return 0;
+}
+
+/* Formats one conversion, `spec` holds "%[flags][width][.precision]".  */
+static int convert(printf_state *st, const char *spec, size_t len,
+                   char conversion) {
+  char buffer[64];
+  const char *arg;
+
+  if (len + 4 > sizeof(buffer)) {
+    fprintf(stderr, "printf: conversion too long\n");
+    st->error = 1;
+    return 0;
+  }
+  memcpy(buffer, spec, len);
+
+  switch (conversion) {
+  case 'd':
+  case 'i':
+    memcpy(buffer + len, "lld", 4);
+    printf(buffer, int_arg(st));
+    break;
+  case 'u':
+  case 'o':
+  case 'x':
+  case 'X':
+    buffer[len] = 'l';
+    buffer[len + 1] = 'l';
+    buffer[len + 2] = conversion;
+    buffer[len + 3] = '\0';
+    printf(buffer, (unsigned long long)int_arg(st));
+    break;
+  case 'f':
+  case 'F':
+  case 'e':
+  case 'E':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+    buffer[len] = conversion;
+    buffer[len + 1] = '\0';
+    printf(buffer, float_arg(st));
+    break;
+  case 'c':
+    arg = next_arg(st);
+    buffer[len] = 'c';
+    buffer[len + 1] = '\0';
+    printf(buffer, arg ? arg[0] : '\0');
+    break;
+  case 's':
+    arg = next_arg(st);
+    buffer[len] = 's';
+    buffer[len + 1] = '\0';
+    printf(buffer, arg ? arg : "");
+    break;
+  case 'b':
+    arg = next_arg(st);
+    if (arg && print_escaped_arg(arg) < 0)
+      return -1;
+    break;
+  default:
+    fprintf(stderr, "printf: %%%c: invalid conversion\n", conversion);
+    st->error = 1;
+    return -1;
+  }
+  return 0;
+}
+
+int printf_command(int argc, char **argv) {
+  printf_state st = {argv, argc, 2, 0};
+  const char *format, *s;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: printf format [arguments]\n");
+    return 2;
+  }
+  format = argv[1];
+
+  do {
+    int start = st.pos;
+
+    for (s = format; *s; s++) {
+      if (*s == '\\') {
+        int n = format_escape(s + 1);
+        if (n < 0)
+          return st.error;
+        s += n;
+      } else if (*s != '%') {
+        putchar(*s);
+      } else if (s[1] == '%') {
+        putchar('%');
+        s++;
+      } else {
+        const char *spec = s++;
+        s += strspn(s, "-+ #0");
+        s += strspn(s, "0123456789");
+        if (*s == '.') {
+          s++;
+          s += strspn(s, "0123456789");
+        }
+        if (!*s) {
+          fprintf(stderr, "printf: %s: missing conversion\n", spec);
+          return 1;
+        }
+        if (convert(&st, spec, s - spec, *s) < 0)
+          return st.error;
+      }
+    }
+    /* Stop if the format did not use any argument.  */
+    if (st.pos == start)
+      break;
+  } while (st.pos < st.argc);
+
+  return st.error;
+}
@@ -0,0 +1,258 @@
+#include "builtins.h"
+
+/*
+ * test and [.
+ *
+ * Recursive descent over the arguments:
+ *   or      := and ( -o and )*
+ *   and     := not ( -a not )*
+ *   not     := ! not | primary
+ *   primary := ( or ) | unary-op word | word binary-op word | word
+ * Like POSIX requires, one, two or three arguments are first read as the
+ * obvious test, so that `test -n` or `[ = = = ]` mean what they look like.
+ */
+
+typedef struct test_state {
+  char **argv;
+  int argc;
+  int pos;
+  int error;
+} test_state;
+
+static const char *peek_arg(test_state *t, int offset) {
+  return t->pos + offset < t->argc ? t->argv[t->pos + offset] : NULL;
+}
+
+static int is_unary(const char *op) {
+  return op && op[0] == '-' && op[1] && !op[2] &&
+         strchr("bcdefghknprsSuwxzLtO", op[1]);
+}
+
+static int is_binary(const char *op) {
+  static const char *ops[] = {"=",   "==",  "!=",  "-eq", "-ne", "-lt", "-le",
+                              "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+  int i;
+
+  if (!op)
+    return 0;
+  for (i = 0; ops[i]; i++)
+    if (strcmp(op, ops[i]) == 0)
+      return 1;
+  return 0;
+}
+
+static long long to_number(test_state *t, const char *s) {
+  char *end;
+  long long value;
+
+  while (isspace((unsigned char)*s))
+    s++;
+  errno = 0;
+  value = strtoll(s, &end, 10);
+  while (isspace((unsigned char)*end))
+    end++;
+  if (end == s || *end || errno) {
+    fprintf(stderr, "test: %s: integer expression expected\n", s);
+    t->error = 1;
+  }
+  return value;
+}
+
+static int unary_test(test_state *t, char op, const char *arg) {
+  struct stat st;
+
+  switch (op) {
+  case 'z':
+    return !*arg;
+  case 'n':
+    return *arg != 0;
+  case 't':
+    return isatty(to_number(t, arg));
+  case 'L':
+  case 'h':
+    return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+  case 'r':
+    return access(arg, R_OK) == 0;
+  case 'w':
+    return access(arg, W_OK) == 0;
+  case 'x':
+    return access(arg, X_OK) == 0;
+  }
+
+  if (stat(arg, &st) < 0)
+    return 0;
+  switch (op) {
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'g':
+    return (st.st_mode & S_ISGID) != 0;
+  case 'k':
+    return (st.st_mode & S_ISVTX) != 0;
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 'u':
+    return (st.st_mode & S_ISUID) != 0;
+  case 'O':
+    return st.st_uid == geteuid();
+  default: /* -e */
+    return 1;
+  }
+}
+
+static int newer(const struct stat *a, const struct stat *b) {
+  return a->st_mtim.tv_sec > b->st_mtim.tv_sec ||
+         (a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+          a->st_mtim.tv_nsec > b->st_mtim.tv_nsec);
+}
+
+static int binary_test(test_state *t, const char *left, const char *op,
+                       const char *right) {
+  struct stat a, b;
+
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+    return strcmp(left, right) == 0;
+  if (strcmp(op, "!=") == 0)
+    return strcmp(left, right) != 0;
+
+  if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+    int has_a = stat(left, &a) == 0, has_b = stat(right, &b) == 0;
+    if (strcmp(op, "-ef") == 0)
+      return has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    if (strcmp(op, "-nt") == 0)
+      return has_a && (!has_b || newer(&a, &b));
+    return has_b && (!has_a || newer(&b, &a));
+  }
+
+  long long l = to_number(t, left), r = to_number(t, right);
+  if (strcmp(op, "-eq") == 0)
+    return l == r;
+  if (strcmp(op, "-ne") == 0)
+    return l != r;
+  if (strcmp(op, "-lt") == 0)
+    return l < r;
+  if (strcmp(op, "-le") == 0)
+    return l <= r;
+  if (strcmp(op, "-gt") == 0)
+    return l > r;
+  return l >= r;
+}
+
+static int parse_or(test_state *t);
+
+static int parse_primary(test_state *t) {
+  const char *arg = peek_arg(t, 0);
+
+  if (!arg) {
+    fprintf(stderr, "test: argument expected\n");
+    t->error = 1;
+    return 0;
+  }
+  if (strcmp(arg, "(") == 0) {
+    int value;
+    t->pos++;
+    value = parse_or(t);
+    if (!peek_arg(t, 0) || strcmp(peek_arg(t, 0), ")") != 0) {
+      fprintf(stderr, "test: `)' expected\n");
+      t->error = 1;
+      return 0;
+    }
+    t->pos++;
+    return value;
+  }
+  if (is_binary(peek_arg(t, 1)) && peek_arg(t, 2)) {
+    t->pos += 3;
+    return binary_test(t, arg, t->argv[t->pos - 2], t->argv[t->pos - 1]);
+  }
+  if (is_unary(arg) && peek_arg(t, 1)) {
+    t->pos += 2;
+    return unary_test(t, arg[1], t->argv[t->pos - 1]);
+  }
+  t->pos++;
+  return *arg != 0;
+}
+
+static int parse_not(test_state *t) {
+  const char *arg = peek_arg(t, 0);
+
+  if (arg && strcmp(arg, "!") == 0 && peek_arg(t, 1)) {
+    t->pos++;
+    return !parse_not(t);
+  }
+  return parse_primary(t);
+}
+
+static int parse_and(test_state *t) {
+  int value = parse_not(t);
+
+  while (peek_arg(t, 0) && strcmp(peek_arg(t, 0), "-a") == 0) {
+    t->pos++;
+    value = parse_not(t) && value;
+  }
+  return value;
+}
+
+static int parse_or(test_state *t) {
+  int value = parse_and(t);
+
+  while (peek_arg(t, 0) && strcmp(peek_arg(t, 0), "-o") == 0) {
+    t->pos++;
+    value = parse_and(t) || value;
+  }
+  return value;
+}
+
+/* test expression, or [ expression ]. Returns 0 if true, 1 if false and 2
+   on a syntax error.  */
+int test_command(int argc, char **argv) {
+  test_state t = {argv + 1, argc - 1, 0, 0};
+  int value;
+
+  if (strcmp(argv[0], "[") == 0) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      fprintf(stderr, "[: missing `]'\n");
+      return 2;
+    }
+    t.argc--;
+  }
+
+  switch (t.argc) {
+  case 0:
+    return 1;
+  case 1:
+    return !*t.argv[0];
+  case 2:
+    if (strcmp(t.argv[0], "!") == 0)
+      return *t.argv[1] != 0;
+    if (is_unary(t.argv[0])) {
+      value = unary_test(&t, t.argv[0][1], t.argv[1]);
+      t.pos = 2;
+    } else
+      value = parse_or(&t);
+    break;
+  case 3:
+    if (is_binary(t.argv[1])) {
+      value = binary_test(&t, t.argv[0], t.argv[1], t.argv[2]);
+      t.pos = 3;
+      break;
+    }
+    /* fall through */
+  default:
+    value = parse_or(&t);
+  }
+
+  if (!t.error && t.pos < t.argc) {
+    fprintf(stderr, "test: %s: unexpected argument\n", t.argv[t.pos]);
+    t.error = 1;
+  }
+  return t.error ? 2 : !value;
+}
@@ -0,0 +1,432 @@
+#include "builtins.h"
+#include "job_time.h"
+#include "history_log.h"
+#include "path_cache.h"
+#include "placement.h"
+#include "scheduler.h"
+#include "xargs.h"
+
+/*
+ * Builtin commands.
+ *
+ * The registry is a static table indexed by a perfect hash computed once at
+ * startup: a lookup is one hash and one strcmp, and names only match
+ * exactly. A builtin typed alone in the foreground runs inside the shell,
+ * with its redirections applied to the shell's own descriptors for the
+ * duration of the call. In a pipeline or in the background it runs in the
+ * forked child, like cp and xargs always do, except for the builtins that
+ * change the shell itself: those jobs are refused.
+ */
+
+static int exit_builtin(int argc, char **argv) {
+  int status = argc > 1 ? atoi(argv[1]) : last_status;
+
+  if (!shell_batch)
+    printf("Exiting mael shell...\n");
+  exit(status & 0xff);
+}
+
+static int cd_builtin(int argc, char **argv) {
+  const char *dir = argc > 1 ? argv[1] : getenv("HOME");
+
+  if (!dir) {
+    fprintf(stderr, "cd: HOME not set\n");
+    return 1;
+  }
+  if (chdir(dir) != 0) {
+    fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/* jobs [-l]  */
+static int jobs_builtin(int argc, char **argv) {
+  int verbose = argc > 1 && strcmp(argv[1], "-l") == 0;
+
+  if (argc > 1 + verbose) {
+    fprintf(stderr, "usage: jobs [-l]\n");
+    return 2;
+  }
+  list_jobs(verbose);
+  return 0;
+}
+
+static int fg_builtin(int argc, char **argv) {
+  do_fg(argc > 1 ? argv[1] : NULL);
+  return last_status;
+}
+
+static int bg_builtin(int argc, char **argv) {
+  do_bg(argc > 1 ? argv[1] : NULL);
+  return 0;
+}
+
+static int true_builtin(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  return 0;
+}
+
+static int false_builtin(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  return 1;
+}
+
+static int pwd_builtin(int argc, char **argv) {
+  char *cwd = getcwd(NULL, 0);
+
+  (void)argc;
+  (void)argv;
+  if (!cwd) {
+    perror("pwd");
+    return 1;
+  }
+  puts(cwd);
+  free(cwd);
+  return 0;
+}
+
+/* Writes the escape sequence at `s`, returns the characters consumed or -1
+   for \c, which stops the output.  */
+int print_escape(const char *s) {
+  int value = 0, n = 1;
+
+  switch (*s) {
+  case 'a':
+    putchar('\a');
+    break;
+  case 'b':
+    putchar('\b');
+    break;
+  case 'c':
+    return -1;
+  case 'e':
+    putchar('\033');
+    break;
+  case 'f':
+    putchar('\f');
+    break;
+  case 'n':
+    putchar('\n');
+    break;
+  case 'r':
+    putchar('\r');
+    break;
+  case 't':
+    putchar('\t');
+    break;
+  case 'v':
+    putchar('\v');
+    break;
+  case '\\':
+    putchar('\\');
+    break;
+  case '0':
+    /* \0nnn: up to three octal digits.  */
+    while (n < 4 && s[n] >= '0' && s[n] <= '7')
+      value = value * 8 + s[n++] - '0';
+    putchar(value);
+    break;
+  default:
+    putchar('\\');
+    return 0;
+  }
+  return n;
+}
+
+/* echo [-neE] [arg ...]  */
+static int echo_builtin(int argc, char **argv) {
+  int newline = 1, escapes = 0, i;
+
+  for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+    const char *flag = argv[i] + 1;
+    if (strspn(flag, "neE") != strlen(flag))
+      break;
+    for (; *flag; flag++) {
+      if (*flag == 'n')
+        newline = 0;
+      else
+        escapes = *flag == 'e';
+    }
+  }
+
+  for (; i < argc; i++) {
+    const char *s = argv[i];
+    if (!escapes)
+      fputs(s, stdout);
+    else
+      for (; *s; s++) {
+        int n;
+        if (*s != '\\') {
+          putchar(*s);
+          continue;
+        }
+        n = print_escape(s + 1);
+        if (n < 0)
+          return 0;
+        s += n;
+      }
+    if (i + 1 < argc)
+      putchar(' ');
+  }
+  if (newline)
+    putchar('\n');
+  return 0;
+}
+
+/* Largest pipe an unprivileged process may ask for.  */
+static long pipe_max_size() {
+  FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+  long size = 1024 * 1024;
+
+  if (f) {
+    if (fscanf(f, "%ld", &size) != 1)
+      size = 1024 * 1024;
+    fclose(f);
+  }
+  return size;
+}
+
+/* pipesize [bytes|max|default]: size of the pipes between the stages of
+   the next jobs. Without argument, prints it.  */
+static int pipesize_builtin(int argc, char **argv) {
+  long size, max = pipe_max_size();
+  char *end;
+
+  if (argc < 2) {
+    if (shell_pipe_size)
+      printf("%d\n", shell_pipe_size);
+    else
+      printf("default\n");
+    return 0;
+  }
+
+  if (strcmp(argv[1], "default") == 0) {
+    shell_pipe_size = 0;
+    return 0;
+  }
+  if (strcmp(argv[1], "max") == 0)
+    size = max;
+  else {
+    size = strtol(argv[1], &end, 0);
+    if (*end == 'k' || *end == 'K')
+      size *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+      size *= 1024 * 1024, end++;
+    if (*end || size <= 0) {
+      fprintf(stderr, "pipesize: %s: invalid size\n", argv[1]);
+      return 2;
+    }
+  }
+  if (size > max) {
+    fprintf(stderr, "pipesize: %ld is above the limit, using %ld\n", size,
+            max);
+    size = max;
+  }
+  shell_pipe_size = size;
+  return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* export [name[=value] ...]: without arguments, lists the environment.  */
+static int export_builtin(int argc, char **argv) {
+  int i, result = 0;
+
+  if (argc == 1) {
+    size_t count = 0, k;
+    char **env, **sorted;
+
+    for (env = environ; *env; env++)
+      count++;
+    sorted = malloc(count * sizeof(char *));
+    if (!sorted) {
+      perror("export");
+      return 1;
+    }
+    memcpy(sorted, environ, count * sizeof(char *));
+    qsort(sorted, count, sizeof(char *), compare_names);
+    for (k = 0; k < count; k++) {
+      const char *equal = strchr(sorted[k], '=');
+      if (equal)
+        printf("export %.*s=\"%s\"\n", (int)(equal - sorted[k]), sorted[k],
+               equal + 1);
+    }
+    free(sorted);
+    return 0;
+  }
+
+  for (i = 1; i < argc; i++) {
+    char *equal = strchr(argv[i], '=');
+    const char *name = argv[i];
+    size_t len = equal ? (size_t)(equal - name) : strlen(name);
+
+    if (!len || (!isalpha((unsigned char)name[0]) && name[0] != '_') ||
+        strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                     "0123456789_") != len) {
+      fprintf(stderr, "export: `%s': not a valid identifier\n", argv[i]);
+      result = 1;
+      continue;
+    }
+    /* Without a value, there is no shell variable to export.  */
+    if (!equal)
+      continue;
+    *equal = '\0';
+    if (setenv(name, equal + 1, 1) < 0) {
+      perror("export");
+      result = 1;
+    }
+    *equal = '=';
+  }
+  return result;
+}
+
+static builtin builtins[] = {
+    {"exit", exit_builtin, BUILTIN_SHELL},
+    {"cd", cd_builtin, BUILTIN_SHELL},
+    {"jobs", jobs_builtin, BUILTIN_SHELL},
+    {"fg", fg_builtin, BUILTIN_SHELL},
+    {"bg", bg_builtin, BUILTIN_SHELL},
+    {"hash", hash_command, BUILTIN_SHELL},
+    {"export", export_builtin, BUILTIN_SHELL},
+    {"pipesize", pipesize_builtin, BUILTIN_SHELL},
+    {"maxjobs", maxjobs_command, BUILTIN_SHELL},
+    {"placement", placement_command, BUILTIN_SHELL},
+    {"history", history_command, BUILTIN_SHELL},
+    {"wait", wait_command, BUILTIN_SHELL},
+    {"echo", echo_builtin, 0},
+    {"pwd", pwd_builtin, 0},
+    {"true", true_builtin, 0},
+    {"false", false_builtin, 0},
+    {"test", test_command, 0},
+    {"[", test_command, 0},
+    {"printf", printf_command, 0},
+    {"cp", copyCommand, BUILTIN_FORK},
+    {"xargs", xargs_command, BUILTIN_FORK},
+    {"cat", cat_command, BUILTIN_FORK},
+    {"tee", tee_command, BUILTIN_FORK},
+};
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+#define BUILTIN_SLOTS 64 // Power of two, at least twice BUILTIN_COUNT
+
+static const builtin *slots[BUILTIN_SLOTS];
+static unsigned hash_seed;
+
+static unsigned name_hash(const char *name, unsigned seed) {
+  unsigned hash = 2166136261u ^ seed; /* FNV-1a */
+
+  while (*name)
+    hash = (hash ^ (unsigned char)*name++) * 16777619u;
+  return (hash ^ (hash >> 15)) & (BUILTIN_SLOTS - 1);
+}
+
+/* Searches a seed for which no two builtins share a slot.  */
+void builtins_init() {
+  size_t i;
+
+  for (hash_seed = 0;; hash_seed++) {
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < BUILTIN_COUNT; i++) {
+      unsigned slot = name_hash(builtins[i].name, hash_seed);
+      if (slots[slot])
+        break;
+      slots[slot] = &builtins[i];
+    }
+    if (i == BUILTIN_COUNT)
+      return;
+  }
+}
+
+const builtin *builtin_find(const char *name) {
+  const builtin *b = slots[name_hash(name, hash_seed)];
+
+  return b && strcmp(b->name, name) == 0 ? b : NULL;
+}
+
+/* The registry itself, for the completion of command names.  */
+const builtin *builtin_list(size_t *count) {
+  *count = BUILTIN_COUNT;
+  return builtins;
+}
+
+/* Points a standard descriptor to `fd`, saving the old one in `saved`.  */
+static int redirect_shell(int fd, int std, int *saved) {
+  *saved = -1;
+  if (fd == std)
+    return 0;
+  *saved = fcntl(std, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+  if (*saved < 0 || dup2(fd, std) < 0) {
+    perror("dup2");
+    return -1;
+  }
+  return 0;
+}
+
+static void restore_shell(int std, int saved) {
+  if (saved < 0)
+    return;
+  dup2(saved, std);
+  close(saved);
+}
+
+/* Runs a job made of a single builtin inside the shell, without forking.
+   Returns 0 if the job has to be launched instead. The job is freed.  */
+int builtin_run_job(job *j) {
+  process *p = j->first_process;
+  const builtin *b;
+  int saved[3] = {-1, -1, -1};
+  struct rusage before;
+
+  if (p->next || j->background) {
+    /* What cd, export... would change in a child is lost: refuse them.  */
+    for (; p; p = p->next) {
+      b = builtin_find(p->argv[0]);
+      if (b && b->flags & BUILTIN_SHELL) {
+        fprintf(stderr, "%s: can't run in a pipeline or in the background\n",
+                b->name);
+        last_status = 1;
+        free_job(j);
+        return 1;
+      }
+    }
+    return 0;
+  }
+  b = builtin_find(p->argv[0]);
+  if (!b || b->flags & BUILTIN_FORK)
+    return 0;
+
+  if (j->timed) {
+    clock_gettime(CLOCK_MONOTONIC, &j->started);
+    getrusage(RUSAGE_SELF, &before);
+  }
+  fflush(stdout);
+  fflush(stderr);
+  if (redirect_shell(j->stdin, STDIN_FILENO, &saved[0]) < 0 ||
+      redirect_shell(j->stdout, STDOUT_FILENO, &saved[1]) < 0 ||
+      redirect_shell(j->stderr, STDERR_FILENO, &saved[2]) < 0)
+    last_status = 1;
+  else
+    last_status = b->run(p->taille, p->argv);
+  fflush(stdout);
+  fflush(stderr);
+  restore_shell(STDIN_FILENO, saved[0]);
+  restore_shell(STDOUT_FILENO, saved[1]);
+  restore_shell(STDERR_FILENO, saved[2]);
+
+  if (j->timed) {
+    /* What the shell used while running the builtin.  */
+    clock_gettime(CLOCK_MONOTONIC, &j->finished);
+    getrusage(RUSAGE_SELF, &p->usage);
+    timersub(&p->usage.ru_utime, &before.ru_utime, &p->usage.ru_utime);
+    timersub(&p->usage.ru_stime, &before.ru_stime, &p->usage.ru_stime);
+    p->completed = 1;
+    job_print_times(j);
+  }
+  free_job(j);
+  return 1;
+}
@@ -0,0 +1,229 @@
+#include "completion.h"
+#include "builtins.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+ * Completion of command names.
+ *
+ * The first word of a command (or of a pipeline stage) is completed from a
+ * sorted index of the builtins and of the executables found in the PATH
+ * directories. Each directory keeps the names read from it and the mtime it
+ * had then: on Tab, the directories are only stat'ed, and just those that
+ * changed are read again before the index is rebuilt. The matches of a
+ * prefix are a range of the index, found by binary search. Other words, and
+ * first words containing a '/', are left to readline's filename completion.
+ */
+
+typedef struct command_dir {
+  char *dir;             /* directory of PATH, "." for an empty element */
+  struct timespec mtime; /* when it was read */
+  int scanned;           /* names is up to date with mtime */
+  char **names;          /* executables found, allocated one by one */
+  size_t count;
+} command_dir;
+
+static char *indexed_path; /* value of PATH the directories come from */
+static command_dir *dirs;
+static int dir_count;
+
+static const char **names; /* sorted, without duplicates */
+static size_t name_count;
+static size_t name_capacity;
+
+static void free_names(command_dir *d) {
+  size_t i;
+
+  for (i = 0; i < d->count; i++)
+    free(d->names[i]);
+  free(d->names);
+  d->names = NULL;
+  d->count = 0;
+}
+
+/* Splits PATH into its directories, none of them read yet.  */
+static void load_path(const char *path) {
+  const char *start, *end;
+  int i;
+
+  for (i = 0; i < dir_count; i++) {
+    free_names(&dirs[i]);
+    free(dirs[i].dir);
+  }
+  free(dirs);
+  free(indexed_path);
+  dirs = NULL;
+  dir_count = 0;
+  indexed_path = strdup(path);
+
+  for (i = 1, start = path; *start; start++)
+    i += *start == ':';
+  dirs = calloc(i, sizeof(command_dir));
+  if (!dirs || !indexed_path)
+    return;
+
+  for (start = path;; start = end + 1) {
+    end = strchrnul(start, ':');
+    dirs[dir_count].dir =
+        end == start ? strdup(".") : strndup(start, end - start);
+    if (dirs[dir_count].dir)
+      dir_count++;
+    if (!*end)
+      break;
+  }
+}
+
+/* Tells whether an entry of a directory is a command the shell can run.  */
+static int is_command(int fd, struct dirent *entry) {
+  struct stat st;
+
+  if (entry->d_name[0] == '.')
+    return 0;
+  if (entry->d_type != DT_REG && entry->d_type != DT_LNK &&
+      entry->d_type != DT_UNKNOWN)
+    return 0;
+  if (entry->d_type != DT_REG &&
+      (fstatat(fd, entry->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)))
+    return 0;
+  return faccessat(fd, entry->d_name, X_OK, 0) == 0;
+}
+
+/* Reads the executables of a directory again.  */
+static void scan_dir(command_dir *d) {
+  struct dirent *entry;
+  size_t capacity = 0;
+  char **grown;
+  DIR *dir;
+
+  free_names(d);
+  d->scanned = 1;
+  dir = opendir(d->dir);
+  if (!dir)
+    return;
+  while ((entry = readdir(dir))) {
+    if (!is_command(dirfd(dir), entry))
+      continue;
+    if (d->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      grown = realloc(d->names, capacity * sizeof(char *));
+      if (!grown)
+        break;
+      d->names = grown;
+    }
+    if ((d->names[d->count] = strdup(entry->d_name)))
+      d->count++;
+  }
+  closedir(dir);
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void index_add(const char *name) {
+  if (name_count == name_capacity) {
+    size_t capacity = name_capacity ? name_capacity * 2 : COMMAND_INDEX_MIN;
+    const char **grown = realloc(names, capacity * sizeof(char *));
+    if (!grown)
+      return;
+    names = grown;
+    name_capacity = capacity;
+  }
+  names[name_count++] = name;
+}
+
+/* Rebuilds the sorted index from the builtins and the directories.  */
+static void index_rebuild() {
+  const builtin *list;
+  size_t i, count, kept;
+  int k;
+
+  name_count = 0;
+  list = builtin_list(&count);
+  for (i = 0; i < count; i++)
+    index_add(list[i].name);
+  for (k = 0; k < dir_count; k++)
+    for (i = 0; i < dirs[k].count; i++)
+      index_add(dirs[k].names[i]);
+
+  qsort(names, name_count, sizeof(char *), compare_names);
+  for (i = kept = 0; i < name_count; i++)
+    if (!kept || strcmp(names[kept - 1], names[i]) != 0)
+      names[kept++] = names[i];
+  name_count = kept;
+}
+
+/* Brings the index up to date: only the directories whose mtime changed
+   are read. Returns the number of commands.  */
+size_t command_index_refresh() {
+  const char *path = getenv("PATH");
+  struct stat st;
+  int i, changed = 0;
+
+  if (!path)
+    path = "/bin:/usr/bin";
+  if (!indexed_path || strcmp(path, indexed_path) != 0) {
+    load_path(path);
+    changed = 1;
+  }
+
+  for (i = 0; i < dir_count; i++) {
+    if (stat(dirs[i].dir, &st) < 0)
+      st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+    if (dirs[i].scanned && st.st_mtim.tv_sec == dirs[i].mtime.tv_sec &&
+        st.st_mtim.tv_nsec == dirs[i].mtime.tv_nsec)
+      continue;
+    dirs[i].mtime = st.st_mtim;
+    scan_dir(&dirs[i]);
+    changed = 1;
+  }
+
+  if (changed || !name_count)
+    index_rebuild();
+  return name_count;
+}
+
+/* First name of the index that is not before `prefix`.  */
+static size_t lower_bound(const char *prefix) {
+  size_t low = 0, high = name_count, middle;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (strcmp(names[middle], prefix) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+/* Readline generator: the commands starting with `text`, in order.  */
+static char *command_generator(const char *text, int state) {
+  static size_t next, length;
+
+  if (!state) {
+    command_index_refresh();
+    next = lower_bound(text);
+    length = strlen(text);
+  }
+  if (next < name_count && strncmp(names[next], text, length) == 0)
+    return strdup(names[next++]);
+  return NULL;
+}
+
+/* Command names for the first word of a stage, file names elsewhere.  */
+static char **complete(const char *text, int start, int end) {
+  int i = start;
+
+  (void)end;
+  while (i > 0 && isspace((unsigned char)rl_line_buffer[i - 1]))
+    i--;
+  if ((i > 0 && rl_line_buffer[i - 1] != '|') || strchr(text, '/'))
+    return NULL;
+  /* Without a match, readline falls back to the file names.  */
+  return rl_completion_matches(text, command_generator);
+}
+
+void completion_init() { rl_attempted_completion_function = complete; }
@@ -1,134 +1,1056 @@
 #include "copy.h"
+#include "copy_links.h"
+#include "copy_parallel.h"
+#include "copy_stats.h"
+#include "copy_uring.h"
+#include "crc32c.h"
+#include "walk.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 
 /**
- * Copies a file from a source path to a target path.
- * This function reads the source file in blocks and writes them to the target
- * file. It also checks that the target file is writable and preserves the
- * access permissions of the source file.
+ * Returns a printable name for a copy method.
  */
-int copyFile(const char *source, const char *target) {
-  // File descriptors for the source (read) and target (write) files
-  int sourceDescriptor = open(source, O_RDONLY);
-  int targetDescriptor = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+const char *copyMethodName(copyMethod method) {
+  switch (method) {
+  case COPY_REFLINK:
+    return "reflink";
+  case COPY_FILE_RANGE:
+    return "copy_file_range";
+  case COPY_SENDFILE:
+    return "sendfile";
+  case COPY_READ_WRITE:
+    return "read/write";
+  case COPY_URING:
+    return "io_uring";
+  case COPY_SPARSE:
+    return "sparse";
+  case COPY_UNCHANGED:
+    return "unchanged";
+  case COPY_CHANGED_BLOCKS:
+    return "changed blocks";
+  case COPY_HARDLINK:
+    return "hardlink";
+  default:
+    return "empty";
+  }
+}
 
-  // Buffer to store file content during transfer
-  char buffer[BUFFER_SIZE];
-  struct stat sourceAccessControl;
-  struct stat targetAccessControl;
+/**
+ * Tells whether a kernel copy primitive failed because it cannot handle this
+ * pair of files (other filesystem, old kernel, special file...), in which case
+ * the next method has to be tried.
+ */
+static int isUnsupported(int error) {
+  return error == ENOSYS || error == EXDEV || error == EINVAL ||
+         error == EOPNOTSUPP || error == ENOTSUP || error == EBADF ||
+         error == EPERM;
+}
+
+/**
+ * Copies the content of an open file to another one, trying the cheapest
+ * method first: reflink, then copy_file_range, then sendfile, and finally a
+ * userspace loop. Both descriptors are used from their current offset, so a
+ * method that stops halfway is simply continued by the next one. `method`
+ * receives the method that moved the data.
+ */
+int copyData(int sourceDescriptor, int targetDescriptor, off_t size,
+             copyMethod *method) {
+  off_t copied = 0;
   ssize_t bytesRead, bytesWritten;
 
-  // Check that the target file is writable
-  stat(target, &targetAccessControl);
-  if (!(targetAccessControl.st_mode & S_IWUSR)) {
-    perror("You can't write the target file");
+  *method = COPY_NONE;
+
+  // Share the extents when the filesystem supports it (btrfs, xfs...)
+  if (size > 0 && ioctl(targetDescriptor, FICLONE, sourceDescriptor) == 0) {
+    *method = COPY_REFLINK;
+    return EXIT_SUCCESS;
+  }
+
+  // Let the kernel copy the data, possibly offloaded to the storage
+  while (copied < size) {
+    bytesWritten = copy_file_range(sourceDescriptor, NULL, targetDescriptor,
+                                   NULL, size - copied, 0);
+    if (bytesWritten > 0) {
+      copied += bytesWritten;
+      if (*method == COPY_NONE)
+        *method = COPY_FILE_RANGE;
+    } else if (bytesWritten == -1 && errno == EINTR) {
+      continue;
+    } else if (bytesWritten == -1 && !isUnsupported(errno)) {
+      perror("Error during copy_file_range");
+      return EXIT_FAILURE;
+    } else {
+      break;
+    }
+  }
+
+  // sendfile still avoids the round trip through userspace
+  while (copied < size) {
+    bytesWritten =
+        sendfile(targetDescriptor, sourceDescriptor, NULL, size - copied);
+    if (bytesWritten > 0) {
+      copied += bytesWritten;
+      if (*method == COPY_NONE)
+        *method = COPY_SENDFILE;
+    } else if (bytesWritten == -1 && errno == EINTR) {
+      continue;
+    } else if (bytesWritten == -1 && !isUnsupported(errno)) {
+      perror("Error during sendfile");
+      return EXIT_FAILURE;
+    } else {
+      break;
+    }
+  }
+
+  // Everything has been copied by the kernel
+  if (size > 0 && copied >= size)
+    return EXIT_SUCCESS;
+
+  // Read the rest (or a file whose size is unknown, like in /proc) block by
+  // block and write it to the target file
+  char *buffer = malloc(BUFFER_SIZE);
+  if (!buffer) {
+    perror("malloc");
     return EXIT_FAILURE;
   }
 
-  // Read from the source file block by block and write to the target file
-  while ((bytesRead = read(sourceDescriptor, buffer, BUFFER_SIZE)) > 0) {
-    bytesWritten = write(targetDescriptor, buffer, bytesRead);
-    if (bytesWritten == -1) {
+  while ((bytesRead = read(sourceDescriptor, buffer, BUFFER_SIZE)) != 0) {
+    if (bytesRead == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("Error during reading from source file");
+      free(buffer);
+      return EXIT_FAILURE;
+    }
+
+    // write() may accept only a part of the block
+    for (ssize_t done = 0; done < bytesRead; done += bytesWritten) {
+      bytesWritten = write(targetDescriptor, buffer + done, bytesRead - done);
+      if (bytesWritten == -1) {
+        if (errno == EINTR) {
+          bytesWritten = 0;
+          continue;
+        }
+        perror("Error during writing to target file");
+        free(buffer);
+        return EXIT_FAILURE;
+      }
+    }
+
+    if (*method == COPY_NONE)
+      *method = COPY_READ_WRITE;
+  }
+
+  free(buffer);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Tells whether a file has holes: fewer blocks allocated than its size needs.
+ */
+static int isSparse(const struct stat *fileStat) {
+  return (off_t)fileStat->st_blocks * 512 < fileStat->st_size;
+}
+
+/**
+ * Tells whether a block only contains zeros.
+ */
+static int isZeroBlock(const char *block, size_t length) {
+  return length == 0 ||
+         (block[0] == 0 && memcmp(block, block + 1, length - 1) == 0);
+}
+
+/**
+ * Copies the range [offset, end) of a data extent. With `zeroHoles`, the
+ * blocks of `blockSize` bytes that only contain zeros are not written, which
+ * leaves holes in the target.
+ */
+static int copyExtent(int sourceDescriptor, int targetDescriptor, off_t offset,
+                      off_t end, int zeroHoles, size_t blockSize,
+                      char *buffer) {
+  // Without zero detection the kernel can move the extent by itself
+  while (!zeroHoles && offset < end) {
+    off_t targetOffset = offset;
+    ssize_t copied = copy_file_range(sourceDescriptor, &offset,
+                                     targetDescriptor, &targetOffset,
+                                     end - offset, 0);
+    if (copied > 0)
+      continue;
+    if (copied == -1 && errno == EINTR)
+      continue;
+    if (copied == -1 && !isUnsupported(errno)) {
+      perror("Error during copy_file_range");
+      return EXIT_FAILURE;
+    }
+    break;
+  }
+
+  while (offset < end) {
+    size_t length = end - offset < BUFFER_SIZE ? end - offset : BUFFER_SIZE;
+    ssize_t bytesRead = pread(sourceDescriptor, buffer, length, offset);
+    if (bytesRead == -1 && errno == EINTR)
+      continue;
+    if (bytesRead == -1) {
+      perror("Error during reading from source file");
+      return EXIT_FAILURE;
+    }
+    if (bytesRead == 0) // The file shrank while being copied
+      break;
+
+    for (ssize_t done = 0; done < bytesRead;) {
+      size_t chunk = bytesRead - done;
+      if (zeroHoles) {
+        chunk = chunk < blockSize ? chunk : blockSize;
+        if (isZeroBlock(buffer + done, chunk)) {
+          done += chunk;
+          continue;
+        }
+      }
+      ssize_t bytesWritten =
+          pwrite(targetDescriptor, buffer + done, chunk, offset + done);
+      if (bytesWritten == -1 && errno == EINTR)
+        continue;
+      if (bytesWritten == -1) {
+        perror("Error during writing to target file");
+        return EXIT_FAILURE;
+      }
+      done += bytesWritten;
+    }
+    offset += bytesRead;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Copies only the data extents of a file, found with SEEK_DATA/SEEK_HOLE, so
+ * that the holes of the source stay holes in the (freshly truncated) target.
+ * With `zeroHoles`, blocks of zeros inside the data extents become holes too.
+ */
+int copySparse(int sourceDescriptor, int targetDescriptor, off_t size,
+               int zeroHoles, size_t blockSize, copyMethod *method) {
+  off_t data = 0, hole;
+  int result = EXIT_SUCCESS;
+
+  *method = COPY_SPARSE;
+
+  // A reflink keeps the holes and shares everything else
+  if (size > 0 && ioctl(targetDescriptor, FICLONE, sourceDescriptor) == 0) {
+    *method = COPY_REFLINK;
+    return EXIT_SUCCESS;
+  }
+
+  char *buffer = malloc(BUFFER_SIZE);
+  if (!buffer) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+  if (blockSize == 0 || blockSize > BUFFER_SIZE)
+    blockSize = 4096;
+
+  while (result == EXIT_SUCCESS && data < size) {
+    data = lseek(sourceDescriptor, data, SEEK_DATA);
+    if (data == -1) {
+      if (errno == ENXIO) // Only a hole up to the end of the file
+        break;
+      // No SEEK_DATA on this filesystem: a single extent
+      data = 0;
+      hole = size;
+    } else {
+      hole = lseek(sourceDescriptor, data, SEEK_HOLE);
+      if (hole == -1 || hole > size)
+        hole = size;
+    }
+
+    result = copyExtent(sourceDescriptor, targetDescriptor, data, hole,
+                        zeroHoles, blockSize, buffer);
+    data = hole;
+  }
+
+  free(buffer);
+
+  // The trailing hole (or a file of zeros) is only a size
+  if (result == EXIT_SUCCESS && ftruncate(targetDescriptor, size) == -1) {
+    perror("Error while setting the size of the target file");
+    return EXIT_FAILURE;
+  }
+  return result;
+}
+
+/**
+ * Reads up to `length` bytes at `offset`, retrying short reads.
+ */
+static ssize_t readBlock(int descriptor, char *buffer, size_t length,
+                         off_t offset) {
+  size_t done = 0;
+
+  while (done < length) {
+    ssize_t bytesRead = pread(descriptor, buffer + done, length - done,
+                              offset + done);
+    if (bytesRead == -1 && errno == EINTR)
+      continue;
+    if (bytesRead == -1)
+      return -1;
+    if (bytesRead == 0)
+      break;
+    done += bytesRead;
+  }
+  return done;
+}
+
+/**
+ * Updates an existing target in place: the source and the target are compared
+ * block by block and only the blocks that differ are rewritten, then the
+ * target is cut to the size of the source. `written` receives the number of
+ * bytes rewritten.
+ */
+static int copyChangedBlocks(int sourceDescriptor, int targetDescriptor,
+                             off_t size, off_t *written) {
+  char *sourceBlock = malloc(INCREMENTAL_BLOCK);
+  char *targetBlock = malloc(INCREMENTAL_BLOCK);
+  int result = EXIT_SUCCESS;
+
+  *written = 0;
+  if (!sourceBlock || !targetBlock) {
+    perror("malloc");
+    free(sourceBlock);
+    free(targetBlock);
+    return EXIT_FAILURE;
+  }
+
+  for (off_t offset = 0; offset < size; offset += INCREMENTAL_BLOCK) {
+    ssize_t sourceLength =
+        readBlock(sourceDescriptor, sourceBlock, INCREMENTAL_BLOCK, offset);
+    ssize_t targetLength =
+        readBlock(targetDescriptor, targetBlock, INCREMENTAL_BLOCK, offset);
+    if (sourceLength == -1 || targetLength == -1) {
+      perror("Error during reading the blocks to compare");
+      result = EXIT_FAILURE;
+      break;
+    }
+    if (sourceLength == 0) // The source shrank while being copied
+      break;
+
+    // Both files are local: comparing the blocks is as cheap as hashing them
+    if (sourceLength == targetLength &&
+        memcmp(sourceBlock, targetBlock, sourceLength) == 0)
+      continue;
+
+    for (ssize_t done = 0; done < sourceLength;) {
+      ssize_t bytesWritten =
+          pwrite(targetDescriptor, sourceBlock + done, sourceLength - done,
+                 offset + done);
+      if (bytesWritten == -1 && errno == EINTR)
+        continue;
+      if (bytesWritten == -1) {
+        perror("Error during writing to target file");
+        result = EXIT_FAILURE;
+        break;
+      }
+      done += bytesWritten;
+    }
+    if (result != EXIT_SUCCESS)
+      break;
+    *written += sourceLength;
+  }
+
+  free(sourceBlock);
+  free(targetBlock);
+
+  if (result == EXIT_SUCCESS && ftruncate(targetDescriptor, size) == -1) {
+    perror("Error while setting the size of the target file");
+    return EXIT_FAILURE;
+  }
+  return result;
+}
+
+/**
+ * Writes a whole block, retrying short writes.
+ */
+static int writeBlock(int descriptor, const char *buffer, size_t length) {
+  for (size_t done = 0; done < length;) {
+    ssize_t bytesWritten = write(descriptor, buffer + done, length - done);
+    if (bytesWritten == -1 && errno == EINTR)
+      continue;
+    if (bytesWritten == -1)
+      return -1;
+    done += bytesWritten;
+  }
+  return 0;
+}
+
+/**
+ * Copies the rest of a file through a userspace buffer and computes the
+ * CRC32C of the data on the way, so that checking the copy does not need
+ * another pass over the source. The kernel methods of copyData never show
+ * the data to the shell, which is why `--verify` uses this loop instead.
+ */
+int copyDataHashed(int sourceDescriptor, int targetDescriptor,
+                   uint32_t *crc) {
+  ssize_t bytesRead;
+
+  *crc = 0;
+  char *buffer = malloc(BUFFER_SIZE);
+  if (!buffer) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+
+  posix_fadvise(sourceDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+  while ((bytesRead = read(sourceDescriptor, buffer, BUFFER_SIZE)) != 0) {
+    if (bytesRead == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("Error during reading from source file");
+      free(buffer);
+      return EXIT_FAILURE;
+    }
+    *crc = crc32cUpdate(*crc, buffer, bytesRead);
+    if (writeBlock(targetDescriptor, buffer, bytesRead) == -1) {
       perror("Error during writing to target file");
-      close(sourceDescriptor);
-      close(targetDescriptor);
+      free(buffer);
       return EXIT_FAILURE;
     }
   }
 
-  if (bytesRead == -1) {
-    perror("Error during reading from source file");
+  free(buffer);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Computes the CRC32C of a whole file with pread, without moving its offset.
+ */
+static int hashFile(int descriptor, uint32_t *crc) {
+  ssize_t bytesRead;
+  off_t offset = 0;
+
+  *crc = 0;
+  char *buffer = malloc(BUFFER_SIZE);
+  if (!buffer) {
+    perror("malloc");
+    return -1;
+  }
+  while ((bytesRead = readBlock(descriptor, buffer, BUFFER_SIZE, offset)) > 0) {
+    *crc = crc32cUpdate(*crc, buffer, bytesRead);
+    offset += bytesRead;
+  }
+  free(buffer);
+  return bytesRead == -1 ? -1 : 0;
+}
+
+/**
+ * Checks a copied file: the target is flushed and dropped from the page
+ * cache, so that reading it back checks what the disk returns, and its
+ * CRC32C must be `expected`. The result goes to the manifest, if any.
+ */
+static int verifyTarget(int targetDescriptor, const char *target,
+                        uint32_t expected, const copyOptions *options) {
+  uint32_t crc;
+
+  if (fdatasync(targetDescriptor) == -1 && errno != EINVAL) {
+    perror("Error while flushing the target file");
+    return EXIT_FAILURE;
+  }
+  posix_fadvise(targetDescriptor, 0, 0, POSIX_FADV_DONTNEED);
+
+  if (hashFile(targetDescriptor, &crc) == -1) {
+    perror("Error during reading back the target file");
+    return EXIT_FAILURE;
+  }
+  if (crc != expected) {
+    fprintf(stderr, "cp: %s: verification failed (crc32c %08x, expected "
+                    "%08x)\n",
+            target, crc, expected);
+    return EXIT_FAILURE;
+  }
+
+  if (options->stats)
+    atomic_fetch_add(&options->stats->filesVerified, 1);
+  if (options->manifest) {
+    pthread_mutex_lock(&options->manifest->lock);
+    fprintf(options->manifest->file, "%08x  %s\n", crc, target);
+    pthread_mutex_unlock(&options->manifest->lock);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Adds a copied or skipped file to the statistics of the copy, if any.
+ */
+void copyStatsCount(const copyOptions *options, off_t written,
+                    off_t skipped) {
+  if (!options->stats)
+    return;
+  atomic_fetch_add(&options->stats->bytesWritten, written);
+  atomic_fetch_add(&options->stats->bytesSkipped, skipped);
+  if (written == 0 && skipped > 0)
+    atomic_fetch_add(&options->stats->filesSkipped, 1);
+}
+
+/**
+ * Copies the file `sourceName` of the directory `sourceDirectory` to
+ * `targetName` in `targetDirectory` (either may be AT_FDCWD). `target` is the
+ * full target path, for the manifest and the hard links.
+ * The data is moved by `copyData`, which picks the fastest method available,
+ * or by `copySparse` for sparse files (and for every file with
+ * `--sparse=always`). The method used is reported in `method` (may be NULL).
+ * It also checks that the target file is writable and preserves the access
+ * permissions of the source file.
+ * In incremental mode, a target with the same size and modification time is
+ * left alone, and a big target that changed only gets its modified blocks
+ * rewritten. The modification time is then copied so that the next run can
+ * skip the file.
+ * With `verify`, the data of a plain copy goes through `copyDataHashed`, and
+ * the sparse and incremental paths hash the source afterwards; the target is
+ * then read back and must have the same CRC32C.
+ * With `links`, a source file with several names is only copied once: its
+ * other names become hard links to the first copy.
+ */
+int copyFileAt(int sourceDirectory, const char *sourceName,
+               int targetDirectory, const char *targetName, const char *target,
+               const copyOptions *options, copyMethod *method) {
+  struct stat sourceAccessControl;
+  struct stat targetAccessControl;
+  copyLink *claimed = NULL;
+  copyMethod used;
+  off_t written;
+  uint32_t crc = 0;
+  int result;
+  int update = 0;
+
+  // File descriptors for the source (read) and target (write) files
+  int sourceDescriptor = openat(sourceDirectory, sourceName, O_RDONLY);
+  if (sourceDescriptor == -1) {
+    perror("Can't open the source file");
+    return EXIT_FAILURE;
+  }
+
+  if (fstat(sourceDescriptor, &sourceAccessControl) == -1) {
+    perror("Error while getting access control of the source file");
     close(sourceDescriptor);
-    close(targetDescriptor);
     return EXIT_FAILURE;
   }
 
+  // Another name of this file was copied already: link to its copy
+  if (options->links && S_ISREG(sourceAccessControl.st_mode) &&
+      sourceAccessControl.st_nlink > 1 &&
+      copyLinkTarget(options->links, &sourceAccessControl, targetDirectory,
+                     targetName, target, &claimed)) {
+    close(sourceDescriptor);
+    if (method)
+      *method = COPY_HARDLINK;
+    return EXIT_SUCCESS;
+  }
+
+  if (options->incremental && S_ISREG(sourceAccessControl.st_mode) &&
+      fstatat(targetDirectory, targetName, &targetAccessControl, 0) == 0 &&
+      S_ISREG(targetAccessControl.st_mode)) {
+    // Same size and modification time: nothing to do
+    if (targetAccessControl.st_size == sourceAccessControl.st_size &&
+        targetAccessControl.st_mtim.tv_sec ==
+            sourceAccessControl.st_mtim.tv_sec &&
+        targetAccessControl.st_mtim.tv_nsec ==
+            sourceAccessControl.st_mtim.tv_nsec) {
+      close(sourceDescriptor);
+      copyStatsCount(options, 0, sourceAccessControl.st_size);
+      copyLinkDone(options->links, claimed, EXIT_SUCCESS);
+      if (method)
+        *method = COPY_UNCHANGED;
+      return EXIT_SUCCESS;
+    }
+    update = sourceAccessControl.st_size >= INCREMENTAL_MIN_SIZE;
+  }
+
+  // Check that the target file is writable (and readable, to verify it)
+  int targetDescriptor =
+      update ? openat(targetDirectory, targetName, O_RDWR)
+             : openat(targetDirectory, targetName,
+                      (options->verify ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC,
+                      0644);
+  if (targetDescriptor == -1) {
+    perror("You can't write the target file");
+    close(sourceDescriptor);
+    copyLinkDone(options->links, claimed, EXIT_FAILURE);
+    return EXIT_FAILURE;
+  }
+
+  written = sourceAccessControl.st_size;
+  if (update) {
+    used = COPY_CHANGED_BLOCKS;
+    result = copyChangedBlocks(sourceDescriptor, targetDescriptor,
+                               sourceAccessControl.st_size, &written);
+  } else if (S_ISREG(sourceAccessControl.st_mode) &&
+             (options->sparse == COPY_SPARSE_ALWAYS ||
+              (options->sparse == COPY_SPARSE_AUTO &&
+               isSparse(&sourceAccessControl)))) {
+    result = copySparse(sourceDescriptor, targetDescriptor,
+                        sourceAccessControl.st_size,
+                        options->sparse == COPY_SPARSE_ALWAYS,
+                        sourceAccessControl.st_blksize, &used);
+  } else if (options->verify) {
+    used = sourceAccessControl.st_size > 0 ? COPY_READ_WRITE : COPY_NONE;
+    result = copyDataHashed(sourceDescriptor, targetDescriptor, &crc);
+  } else {
+    result = copyData(sourceDescriptor, targetDescriptor,
+                      sourceAccessControl.st_size, &used);
+  }
+  if (method)
+    *method = used;
+
+  // The data did not stream through copyDataHashed: hash the source now
+  if (result == EXIT_SUCCESS && options->verify &&
+      (used != COPY_READ_WRITE && used != COPY_NONE) &&
+      hashFile(sourceDescriptor, &crc) == -1) {
+    perror("Error during hashing the source file");
+    result = EXIT_FAILURE;
+  }
+  if (result == EXIT_SUCCESS && options->verify)
+    result = verifyTarget(targetDescriptor, target, crc, options);
+
+  if (result == EXIT_SUCCESS) {
+    copyStatsCount(options, written, sourceAccessControl.st_size - written);
+
+    // Copy the access permissions from the source file to the target file
+    fchmod(targetDescriptor, sourceAccessControl.st_mode);
+
+    // Keep the modification time so that the next run can skip the file
+    if (options->incremental) {
+      struct timespec times[2] = {sourceAccessControl.st_atim,
+                                  sourceAccessControl.st_mtim};
+      futimens(targetDescriptor, times);
+    }
+  }
+
   // Close file descriptors
   close(sourceDescriptor);
   close(targetDescriptor);
 
-  // Copy the access permissions from the source file to the target file
-  if (stat(source, &sourceAccessControl) == -1) {
-    perror("Error while getting access control of the source file");
-    return EXIT_FAILURE;
-  }
-  chmod(target, sourceAccessControl.st_mode);
+  // The other names of the file can now be linked to the target
+  copyLinkDone(options->links, claimed, result);
+  return result;
+}
 
-  return EXIT_SUCCESS;
+/**
+ * Copies a file from a source path to a target path, see copyFileAt.
+ */
+int copyFileWithOptions(const char *source, const char *target,
+                        const copyOptions *options, copyMethod *method) {
+  return copyFileAt(AT_FDCWD, source, AT_FDCWD, target, target, options,
+                    method);
+}
+
+/**
+ * Copies a file from a source path to a target path.
+ */
+int copyFile(const char *source, const char *target) {
+  copyOptions options;
+
+  copyOptionsInit(&options);
+  return copyFileWithOptions(source, target, &options, NULL);
 }
 
 /**
  * Recursively copies a directory (and its content) from a source path to a
- * target path. If the source is a regular file, it calls `copyFile`. Otherwise,
- * it creates the directory structure and copies each item individually.
+ * target path with the default options.
  */
 int copyDirectory(const char *source, const char *target) {
-  struct dirent *entry;
-  struct stat fileStat;
-  struct stat sourceAccessControl;
-  char sourcePath[1024];
-  char targetPath[1024];
+  copyOptions options;
 
-  // Get information about the source to determine its type
-  if (stat(source, &sourceAccessControl) == -1) {
-    perror("Error while getting access control of the source directory");
-    return EXIT_FAILURE;
+  copyOptionsInit(&options);
+  return copyDirectoryWithOptions(source, target, &options);
+}
+
+/* State of a sequential directory copy, see copyEntry. */
+typedef struct copyWalk {
+  const copyOptions *options;
+  const char *target;   /* target of the root */
+  size_t sourceLength;  /* length of the source root in the walk paths */
+  char *targetPath;     /* target of the current entry, for messages */
+  size_t targetCapacity;
+  int targetDirectory;  /* directory being filled, -1 outside of the tree */
+  char *batchSources[URING_BATCH];
+  char *batchTargets[URING_BATCH];
+  int batchCount;
+  int failed;
+} copyWalk;
+
+/**
+ * Copies the regular files gathered by copyEntry in one io_uring batch, then
+ * empties the batch. The batch reports every file that fails.
+ */
+static void flushBatch(copyWalk *walk) {
+  if (uringCopyFiles((const char **)walk->batchSources,
+                     (const char **)walk->batchTargets, walk->batchCount,
+                     walk->options) > 0)
+    walk->failed = 1;
+  for (int i = 0; i < walk->batchCount; i++) {
+    free(walk->batchSources[i]);
+    free(walk->batchTargets[i]);
   }
+  walk->batchCount = 0;
+}
+
+/**
+ * Builds the target path of a source path of the walk: the target root
+ * followed by what comes after the source root.
+ */
+static int setTargetPath(copyWalk *walk, const char *source) {
+  const char *relative = source + walk->sourceLength;
+  size_t targetLength = strlen(walk->target);
+  size_t needed = targetLength + strlen(relative) + 1;
 
-  // If it's a regular file, just call copyFile
-  if (S_ISREG(sourceAccessControl.st_mode)) {
-    return copyFile(source, target);
+  if (needed > walk->targetCapacity) {
+    size_t capacity = walk->targetCapacity ? walk->targetCapacity : 256;
+    while (capacity < needed)
+      capacity *= 2;
+    char *path = realloc(walk->targetPath, capacity);
+    if (!path)
+      return -1;
+    walk->targetPath = path;
+    walk->targetCapacity = capacity;
   }
+  memcpy(walk->targetPath, walk->target, targetLength);
+  strcpy(walk->targetPath + targetLength, relative);
+  return 0;
+}
 
-  // Open the source directory
-  DIR *sourceDirectory = opendir(source);
-  if (sourceDirectory == NULL) {
-    perror("Can't open input directory");
-    return EXIT_FAILURE;
+/**
+ * Copies a file of the walk into the current target directory, or adds it
+ * to the io_uring batch.
+ */
+static void copyWalkFile(copyWalk *walk, const walkEntry *entry) {
+  const copyOptions *options = walk->options;
+  copyMethod method = COPY_NONE;
+  int result;
+
+  if (entry->type != DT_REG) {
+    fprintf(stderr, "%s: not a regular file or a directory\n", entry->path);
+    copyReportFile(options, entry->path, walk->targetPath, method,
+                   EXIT_FAILURE);
+    walk->failed = 1;
+    return;
   }
 
-  // Create and/or open the target directory
-  DIR *targetDirectory = opendir(target);
-  if (targetDirectory == NULL) {
-    mkdir(target, 0755);
-    targetDirectory = opendir(target);
-    if (targetDirectory == NULL) {
-      perror("Can't copy the directory");
-      return EXIT_FAILURE;
+  // Regular files are stat'ed by the io_uring batch itself. The batch
+  // writes whole files, so it is not used when zero blocks become holes,
+  // and it does not checksum them either. It opens paths, so the files of
+  // very deep directories are copied here.
+  if (options->backend == COPY_BACKEND_URING &&
+      options->sparse != COPY_SPARSE_ALWAYS && !options->verify &&
+      entry->depth > 0 && strlen(walk->targetPath) < PATH_MAX &&
+      strlen(entry->path) < PATH_MAX) {
+    char **source = &walk->batchSources[walk->batchCount];
+    char **target = &walk->batchTargets[walk->batchCount];
+    *source = strdup(entry->path);
+    *target = strdup(walk->targetPath);
+    if (*source && *target) {
+      if (++walk->batchCount == URING_BATCH)
+        flushBatch(walk);
+      return;
     }
+    free(*source);
+    free(*target);
   }
 
-  // Loop through the entries in the source directory
-  while ((entry = readdir(sourceDirectory)) != NULL) {
-    // Skip the "." and ".." entries
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
+  // The root itself may be a file, copied to the target path
+  if (entry->depth == 0)
+    result = copyFileAt(AT_FDCWD, entry->name, AT_FDCWD, walk->target,
+                        walk->target, options, &method);
+  else
+    result = copyFileAt(entry->parent, entry->name, walk->targetDirectory,
+                        entry->name, walk->targetPath, options, &method);
+  copyReportFile(options, entry->path, walk->targetPath, method, result);
+  if (result != EXIT_SUCCESS)
+    walk->failed = 1;
+}
+
+/**
+ * Creates (or opens) the target of a directory of the walk, and makes it the
+ * current target directory.
+ */
+static walkAction enterTargetDirectory(copyWalk *walk,
+                                       const walkEntry *entry) {
+  int parent = entry->depth == 0 ? AT_FDCWD : walk->targetDirectory;
+  const char *name = entry->depth == 0 ? walk->target : entry->name;
+  int fd = -1;
+
+  // Create and/or open the target directory. Below the root, a symbolic link
+  // is not followed out of the target tree.
+  if (mkdirat(parent, name, 0755) == 0 || errno == EEXIST)
+    fd = openat(parent, name,
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+                    (entry->depth == 0 ? 0 : O_NOFOLLOW));
+  if (fd == -1) {
+    perror("Can't copy the directory");
+    copyReportDirectory(walk->options, entry->path, walk->targetPath,
+                        EXIT_FAILURE);
+    walk->failed = 1;
+    return entry->depth == 0 ? WALK_STOP : WALK_SKIP;
+  }
+
+  if (walk->targetDirectory != -1)
+    close(walk->targetDirectory);
+  walk->targetDirectory = fd;
+  return WALK_CONTINUE;
+}
+
+/**
+ * Finishes the target of a directory whose entries were all copied, and
+ * goes back to its parent.
+ */
+static walkAction leaveTargetDirectory(copyWalk *walk,
+                                       const walkEntry *entry) {
+  int parent = -1;
+
+  // The permissions may forbid writing: the files come first
+  if (walk->batchCount > 0)
+    flushBatch(walk);
+
+  if (entry->depth > 0) {
+    parent = openat(walk->targetDirectory, "..",
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parent == -1) {
+      perror("Can't go back to the parent directory");
+      walk->failed = 1;
     }
+  }
 
-    // Build full paths for the source and target entries
-    snprintf(sourcePath, sizeof(sourcePath), "%s/%s", source, entry->d_name);
-    snprintf(targetPath, sizeof(targetPath), "%s/%s", target, entry->d_name);
+  // Apply source directory permissions to the target directory
+  fchmod(walk->targetDirectory, entry->stat->st_mode);
+  close(walk->targetDirectory);
+  walk->targetDirectory = parent;
+  copyReportDirectory(walk->options, entry->path, walk->targetPath,
+                      EXIT_SUCCESS);
+
+  return entry->depth > 0 && parent == -1 ? WALK_STOP : WALK_CONTINUE;
+}
 
-    // Get information about the current source entry
-    if (stat(sourcePath, &fileStat) == -1) {
-      perror("Error retrieving file information");
-      closedir(sourceDirectory);
+/**
+ * Callback of the walk of the source tree, see copyDirectoryWithOptions.
+ */
+static walkAction copyEntry(const walkEntry *entry, void *context) {
+  copyWalk *walk = context;
+
+  if (setTargetPath(walk, entry->path) == -1) {
+    perror("malloc");
+    walk->failed = 1;
+    return WALK_STOP;
+  }
+
+  switch (entry->event) {
+  case WALK_FILE:
+    copyWalkFile(walk, entry);
+    return WALK_CONTINUE;
+  case WALK_DIRECTORY:
+    return enterTargetDirectory(walk, entry);
+  case WALK_DIRECTORY_END:
+    return leaveTargetDirectory(walk, entry);
+  default:
+    fprintf(stderr, "Can't read %s: %s\n", entry->path,
+            strerror(entry->error));
+    if (entry->type == DT_DIR)
+      copyReportDirectory(walk->options, entry->path, walk->targetPath,
+                          EXIT_FAILURE);
+    else
+      copyReportFile(walk->options, entry->path, walk->targetPath, COPY_NONE,
+                     EXIT_FAILURE);
+    walk->failed = 1;
+    return WALK_CONTINUE;
+  }
+}
+
+/**
+ * Copies a directory (and its content) from a source path to a target path.
+ * If the source is a regular file, it is copied to the target path.
+ * Otherwise, the source tree is walked with walkTree: every directory is
+ * created relative to the target directory of its parent, every file is
+ * copied with copyFileAt relative to both directories, and the permissions
+ * of a directory are applied once its entries are copied. Symbolic links are
+ * followed. With the io_uring backend, the regular files are copied by
+ * batches of URING_BATCH files.
+ */
+int copyDirectoryWithOptions(const char *source, const char *target,
+                             const copyOptions *options) {
+  copyWalk walk = {.options = options,
+                   .target = target,
+                   .sourceLength = strlen(source),
+                   .targetDirectory = -1};
+  int stopped = walkTree(source, WALK_FOLLOW, copyEntry, &walk);
+
+  if (walk.batchCount > 0)
+    flushBatch(&walk);
+  if (walk.targetDirectory != -1)
+    close(walk.targetDirectory);
+  free(walk.targetPath);
+
+  return stopped || walk.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Fills `options` with the default behaviour of `cp`: a sequential copy.
+ */
+void copyOptionsInit(copyOptions *options) {
+  options->jobs = 1;
+  options->backend = COPY_BACKEND_SYNC;
+  options->sparse = COPY_SPARSE_AUTO;
+  options->incremental = 0;
+  options->verify = 0;
+  options->manifest = NULL;
+  options->links = NULL;
+  options->stats = NULL;
+}
+
+/**
+ * Entry point of the `cp` builtin:
+ *   cp [-j N] [-u] [--backend=sync|uring] [--sparse=auto|always|never]
+ *      source target
+ * `-j N` copies directories with N worker threads (0 = one per CPU).
+ * `--backend=uring` batches the small files of each directory in io_uring
+ * (sequential copies only), falling back to `sync` when it is unavailable.
+ * `--sparse` chooses when holes are kept: for sparse sources (auto), never,
+ * or always, in which case blocks of zeros also become holes.
+ * `-u` (`--incremental`) skips the files that did not change since the last
+ * copy and only rewrites the changed blocks of big files, and the summary
+ * tells how many bytes were skipped.
+ * Files are not listed: a progress line is kept on stderr when it is a
+ * terminal, and a summary is printed at the end. `-v` lists every file,
+ * `-q` only prints the errors, `--json` prints the summary as JSON.
+ * `--verify` checksums every copied file with CRC32C and reads the target back
+ * to compare. `--manifest[=path]` also writes the checksums, by default to the
+ * target path followed by MANIFEST_SUFFIX.
+ * The names of a source file with several hard links are hard links to a
+ * single copy at the target, unless `--no-links` copies each of them.
+ */
+int copyCommand(int argc, char **argv) {
+  copyOptions options;
+  copyStats stats;
+  copyReportMode report = COPY_REPORT_SUMMARY;
+  copyManifest manifest;
+  copyLinks links;
+  int preserveLinks = 1;
+  int result;
+  const char *operands[2];
+  const char *manifestPath = NULL;
+  char *defaultManifest = NULL;
+  int operandCount = 0;
+  int writeManifest = 0;
+
+  copyOptionsInit(&options);
+
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "-j", 2) == 0) {
+      const char *value = argv[i][2] ? argv[i] + 2 : argv[++i];
+      if (!value) {
+        fprintf(stderr, "cp: option -j needs a number of jobs\n");
+        return EXIT_FAILURE;
+      }
+      options.jobs = atoi(value);
+      if (options.jobs <= 0)
+        options.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    } else if (strcmp(argv[i], "-u") == 0 ||
+               strcmp(argv[i], "--incremental") == 0) {
+      options.incremental = 1;
+    } else if (strcmp(argv[i], "-q") == 0 ||
+               strcmp(argv[i], "--quiet") == 0) {
+      report = COPY_REPORT_QUIET;
+    } else if (strcmp(argv[i], "-v") == 0 ||
+               strcmp(argv[i], "--verbose") == 0) {
+      report = COPY_REPORT_VERBOSE;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      report = COPY_REPORT_JSON;
+    } else if (strcmp(argv[i], "--no-links") == 0) {
+      preserveLinks = 0;
+    } else if (strcmp(argv[i], "--verify") == 0) {
+      options.verify = 1;
+    } else if (strcmp(argv[i], "--manifest") == 0 ||
+               strncmp(argv[i], "--manifest=", 11) == 0) {
+      options.verify = 1;
+      writeManifest = 1;
+      if (argv[i][10] == '=')
+        manifestPath = argv[i] + 11;
+    } else if (strncmp(argv[i], "--backend=", 10) == 0) {
+      if (strcmp(argv[i] + 10, "uring") == 0) {
+        options.backend = COPY_BACKEND_URING;
+      } else if (strcmp(argv[i] + 10, "sync") == 0) {
+        options.backend = COPY_BACKEND_SYNC;
+      } else {
+        fprintf(stderr, "cp: unknown backend %s\n", argv[i] + 10);
+        return EXIT_FAILURE;
+      }
+    } else if (strncmp(argv[i], "--sparse=", 9) == 0) {
+      if (strcmp(argv[i] + 9, "auto") == 0) {
+        options.sparse = COPY_SPARSE_AUTO;
+      } else if (strcmp(argv[i] + 9, "always") == 0) {
+        options.sparse = COPY_SPARSE_ALWAYS;
+      } else if (strcmp(argv[i] + 9, "never") == 0) {
+        options.sparse = COPY_SPARSE_NEVER;
+      } else {
+        fprintf(stderr, "cp: unknown sparse mode %s\n", argv[i] + 9);
+        return EXIT_FAILURE;
+      }
+    } else if (operandCount < 2) {
+      operands[operandCount++] = argv[i];
+    } else {
+      fprintf(stderr, "cp: too many arguments\n");
       return EXIT_FAILURE;
     }
+  }
 
-    // Recursively copy (either file or subdirectory)
-    if (copyDirectory(sourcePath, targetPath) != EXIT_SUCCESS) {
-      fprintf(stderr, "Failed to copy %s to %s\n", sourcePath, targetPath);
-    } else {
-      printf("Successfully copied %s to %s\n", sourcePath, targetPath);
+  if (operandCount != 2) {
+    fprintf(stderr, "usage: cp [-j N] [-u] [-q|-v|--json] [--verify] "
+                    "[--manifest[=path]] [--no-links] [--backend=sync|uring] "
+                    "[--sparse=auto|always|never] source target\n");
+    return EXIT_FAILURE;
+  }
+
+  if (writeManifest) {
+    if (!manifestPath) {
+      defaultManifest = malloc(strlen(operands[1]) + sizeof(MANIFEST_SUFFIX));
+      if (!defaultManifest) {
+        perror("Can't write the manifest");
+        return EXIT_FAILURE;
+      }
+      strcpy(defaultManifest, operands[1]);
+      strcat(defaultManifest, MANIFEST_SUFFIX);
+      manifestPath = defaultManifest;
+    }
+    manifest.file = fopen(manifestPath, "w");
+    free(defaultManifest);
+    if (!manifest.file) {
+      perror("Can't write the manifest");
+      return EXIT_FAILURE;
     }
+    pthread_mutex_init(&manifest.lock, NULL);
+    options.manifest = &manifest;
   }
 
-  // Close directory streams
-  closedir(sourceDirectory);
-  closedir(targetDirectory);
+  // Without memory for the table, every name is copied separately
+  if (preserveLinks && copyLinksInit(&links) == 0)
+    options.links = &links;
 
-  // Apply source directory permissions to the target directory
-  chmod(target, sourceAccessControl.st_mode);
+  copyStatsInit(&stats, report);
+  options.stats = &stats;
+  if (options.jobs > 1)
+    result = copyDirectoryParallel(operands[0], operands[1], &options);
+  else
+    result = copyDirectoryWithOptions(operands[0], operands[1], &options);
 
-  return EXIT_SUCCESS;
+  if (options.manifest) {
+    if (fclose(manifest.file) == EOF) {
+      perror("Error while writing the manifest");
+      result = EXIT_FAILURE;
+    }
+    pthread_mutex_destroy(&manifest.lock);
+  }
+  if (options.links)
+    copyLinksDestroy(options.links);
+  copyStatsSummary(&stats, &options);
+  if (atomic_load(&stats.failures))
+    result = EXIT_FAILURE;
+  return result;
 }
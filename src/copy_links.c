@@ -0,0 +1,167 @@
+#include "copy_links.h"
+
+#include <errno.h>
+
+/*
+ * Hard links of a tree copy.
+ *
+ * Copying every name of a source file separately makes a tree full of hard
+ * links (package caches, deduplicated snapshots) several times bigger at the
+ * target. Files with more than one name are recorded by (st_dev, st_ino) in
+ * a chained hash table, with the target of the first name met. The first
+ * name is copied as usual, every later name becomes a hard link to that
+ * target. With worker threads, a later name can be met while the first one
+ * is still being copied: it waits for that copy, and copies the data itself
+ * if the copy failed.
+ */
+
+/* State of the first name of an inode. */
+enum { LINK_COPYING, LINK_COPIED, LINK_FAILED };
+
+static size_t linkHash(const copyLinks *links, dev_t device, ino_t inode) {
+  // Fibonacci hashing spreads consecutive inode numbers over the buckets
+  return (((size_t)inode ^ ((size_t)device << 32)) * 11400714819323198485ull) &
+         (links->bucketCount - 1);
+}
+
+/**
+ * Doubles the number of buckets. On failure, the current table is kept:
+ * longer chains, but still correct.
+ */
+static void linksGrow(copyLinks *links) {
+  size_t count = links->bucketCount * 2;
+  copyLink **buckets = calloc(count, sizeof(copyLink *));
+  copyLink **old = links->buckets;
+  size_t oldCount = links->bucketCount;
+
+  if (!buckets)
+    return;
+  links->buckets = buckets;
+  links->bucketCount = count;
+  for (size_t i = 0; i < oldCount; i++) {
+    copyLink *link = old[i], *next;
+    for (; link; link = next) {
+      next = link->next;
+      size_t bucket = linkHash(links, link->device, link->inode);
+      link->next = buckets[bucket];
+      buckets[bucket] = link;
+    }
+  }
+  free(old);
+}
+
+/**
+ * Prepares an empty table. Returns -1 if memory is missing.
+ */
+int copyLinksInit(copyLinks *links) {
+  links->bucketCount = LINK_BUCKETS_MIN;
+  links->count = 0;
+  links->buckets = calloc(links->bucketCount, sizeof(copyLink *));
+  if (!links->buckets)
+    return -1;
+  pthread_mutex_init(&links->lock, NULL);
+  pthread_cond_init(&links->copied, NULL);
+  return 0;
+}
+
+void copyLinksDestroy(copyLinks *links) {
+  for (size_t i = 0; i < links->bucketCount; i++) {
+    copyLink *link = links->buckets[i], *next;
+    for (; link; link = next) {
+      next = link->next;
+      free(link->target);
+      free(link);
+    }
+  }
+  free(links->buckets);
+  pthread_mutex_destroy(&links->lock);
+  pthread_cond_destroy(&links->copied);
+}
+
+/**
+ * Makes `name` in `directory` another name of `first`. A name that is
+ * already a link to `first` (left by an earlier `cp -u`) is kept, anything
+ * else is replaced.
+ */
+static int makeLink(const char *first, int directory, const char *name) {
+  struct stat firstStat;
+  struct stat targetStat;
+
+  if (fstatat(directory, name, &targetStat, AT_SYMLINK_NOFOLLOW) == 0) {
+    if (stat(first, &firstStat) == 0 &&
+        firstStat.st_dev == targetStat.st_dev &&
+        firstStat.st_ino == targetStat.st_ino)
+      return 1;
+    if (unlinkat(directory, name, 0) == -1)
+      return 0;
+  }
+  return linkat(AT_FDCWD, first, directory, name, 0) == 0;
+}
+
+/**
+ * Looks up the inode of a source file that has several names. If another
+ * name of it was copied already, `targetName` in `targetDirectory` (whose
+ * full path is `target`) is made a hard link to its copy and 1 is returned.
+ * Otherwise 0 is returned and the caller copies the file itself; when this
+ * is the first name met, `claimed` is set and the caller must call
+ * copyLinkDone once the copy is over.
+ */
+int copyLinkTarget(copyLinks *links, const struct stat *source,
+                   int targetDirectory, const char *targetName,
+                   const char *target, copyLink **claimed) {
+  copyLink *link;
+
+  *claimed = NULL;
+  pthread_mutex_lock(&links->lock);
+  for (link = links->buckets[linkHash(links, source->st_dev, source->st_ino)];
+       link; link = link->next)
+    if (link->device == source->st_dev && link->inode == source->st_ino)
+      break;
+
+  if (!link) {
+    // First name of this inode: the caller copies it
+    link = malloc(sizeof(copyLink));
+    if (link)
+      link->target = strdup(target);
+    if (!link || !link->target) {
+      free(link);
+      pthread_mutex_unlock(&links->lock);
+      return 0;
+    }
+    link->device = source->st_dev;
+    link->inode = source->st_ino;
+    link->state = LINK_COPYING;
+    if (links->count >= links->bucketCount)
+      linksGrow(links);
+    size_t bucket = linkHash(links, link->device, link->inode);
+    link->next = links->buckets[bucket];
+    links->buckets[bucket] = link;
+    links->count++;
+    *claimed = link;
+    pthread_mutex_unlock(&links->lock);
+    return 0;
+  }
+
+  // Another worker may still be writing the first name
+  while (link->state == LINK_COPYING)
+    pthread_cond_wait(&links->copied, &links->lock);
+  int copied = link->state == LINK_COPIED;
+  pthread_mutex_unlock(&links->lock);
+
+  // The target of an entry never changes, it can be read without the lock.
+  // If the link can't be made (EMLINK...), the data is copied instead.
+  return copied && makeLink(link->target, targetDirectory, targetName);
+}
+
+/**
+ * Publishes the result of the copy of a first name, and wakes up the later
+ * names waiting for it.
+ */
+void copyLinkDone(copyLinks *links, copyLink *claimed, int result) {
+  if (!claimed)
+    return;
+  pthread_mutex_lock(&links->lock);
+  claimed->state = result == EXIT_SUCCESS ? LINK_COPIED : LINK_FAILED;
+  pthread_cond_broadcast(&links->copied);
+  pthread_mutex_unlock(&links->lock);
+}
@@ -0,0 +1,481 @@
+#include "copy_parallel.h"
+#include "copy_stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+/*
+ * Parallel tree copy.
+ *
+ * Every worker owns a deque of tasks. A worker pushes and pops at the bottom
+ * of its own deque (depth first, so the tree is not fully expanded in memory)
+ * and steals from the top of the other deques when its own one is empty.
+ * A task either scans a directory, which pushes one task per entry, or copies
+ * a single file.
+ *
+ * A directory is created by the task that scans it, before its children are
+ * pushed, so a parent always exists before its children are written. Each
+ * directory counts its unfinished children; the last one to finish applies
+ * the permissions of the source directory, as copyDirectory does at the end.
+ */
+
+/* A target directory waiting for its children before its chmod. */
+typedef struct copyDir {
+  struct copyDir *parent;
+  char *target;
+  mode_t mode;
+  atomic_int pending; /* unfinished children + 1 for the scan itself */
+} copyDir;
+
+typedef struct copyTask {
+  char *source;
+  char *target;
+  int isDirectory;
+  copyDir *parent; /* directory that contains the entry */
+} copyTask;
+
+/* Growable ring buffer of tasks, protected by its own lock. */
+typedef struct taskDeque {
+  pthread_mutex_t lock;
+  copyTask **tasks;
+  size_t capacity;
+  size_t top;    /* index of the oldest task (stolen first) */
+  size_t bottom; /* index after the newest task (popped first) */
+} taskDeque;
+
+typedef struct copyPool {
+  taskDeque *deques;
+  int workerCount;
+  const copyOptions *options;
+
+  atomic_long outstanding; /* tasks pushed and not finished yet */
+  atomic_long queued;      /* tasks sitting in a deque */
+  atomic_int idle;         /* workers sleeping on `wakeUp` */
+  atomic_int failures;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeUp;
+
+  int openFds; /* descriptors currently opened by the workers */
+  int maxFds;
+  pthread_mutex_t fdLock;
+  pthread_cond_t fdAvailable;
+} copyPool;
+
+typedef struct copyWorker {
+  copyPool *pool;
+  int index;
+  unsigned int seed; /* to pick a victim when stealing */
+} copyWorker;
+
+static int dequeInit(taskDeque *deque) {
+  deque->capacity = 64;
+  deque->top = deque->bottom = 0;
+  deque->tasks = malloc(deque->capacity * sizeof(copyTask *));
+  if (!deque->tasks)
+    return -1;
+  pthread_mutex_init(&deque->lock, NULL);
+  return 0;
+}
+
+static void dequeDestroy(taskDeque *deque) {
+  pthread_mutex_destroy(&deque->lock);
+  free(deque->tasks);
+}
+
+static int dequePush(taskDeque *deque, copyTask *task) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom - deque->top == deque->capacity) {
+    size_t capacity = deque->capacity * 2;
+    copyTask **tasks = malloc(capacity * sizeof(copyTask *));
+    if (!tasks) {
+      pthread_mutex_unlock(&deque->lock);
+      return -1;
+    }
+    for (size_t i = deque->top; i < deque->bottom; i++)
+      tasks[i % capacity] = deque->tasks[i % deque->capacity];
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->capacity = capacity;
+  }
+  deque->tasks[deque->bottom++ % deque->capacity] = task;
+  pthread_mutex_unlock(&deque->lock);
+  return 0;
+}
+
+/* Owner side: newest task first. */
+static copyTask *dequePop(taskDeque *deque) {
+  copyTask *task = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom != deque->top)
+    task = deque->tasks[--deque->bottom % deque->capacity];
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+/* Thief side: oldest task first, usually the biggest piece of work. */
+static copyTask *dequeSteal(taskDeque *deque) {
+  copyTask *task = NULL;
+
+  if (pthread_mutex_trylock(&deque->lock) != 0)
+    return NULL;
+  if (deque->bottom != deque->top)
+    task = deque->tasks[deque->top++ % deque->capacity];
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+/* Blocks until `count` more descriptors can be opened. */
+static void acquireFds(copyPool *pool, int count) {
+  pthread_mutex_lock(&pool->fdLock);
+  while (pool->openFds + count > pool->maxFds)
+    pthread_cond_wait(&pool->fdAvailable, &pool->fdLock);
+  pool->openFds += count;
+  pthread_mutex_unlock(&pool->fdLock);
+}
+
+static void releaseFds(copyPool *pool, int count) {
+  pthread_mutex_lock(&pool->fdLock);
+  pool->openFds -= count;
+  pthread_cond_broadcast(&pool->fdAvailable);
+  pthread_mutex_unlock(&pool->fdLock);
+}
+
+static char *joinPath(const char *directory, const char *name) {
+  size_t length = strlen(directory) + strlen(name) + 2;
+  char *path = malloc(length);
+  if (path)
+    snprintf(path, length, "%s/%s", directory, name);
+  return path;
+}
+
+static void freeTask(copyTask *task) {
+  free(task->source);
+  free(task->target);
+  free(task);
+}
+
+/**
+ * Marks one child of `dir` as finished. When it was the last one, the
+ * permissions of the source directory are applied and the parent is notified
+ * in turn.
+ */
+static void finishChild(copyDir *dir) {
+  while (dir && atomic_fetch_sub(&dir->pending, 1) == 1) {
+    copyDir *parent = dir->parent;
+
+    // Apply source directory permissions to the target directory
+    chmod(dir->target, dir->mode);
+    free(dir->target);
+    free(dir);
+    dir = parent;
+  }
+}
+
+static void pushTask(copyWorker *worker, copyTask *task) {
+  copyPool *pool = worker->pool;
+
+  atomic_fetch_add(&task->parent->pending, 1);
+  atomic_fetch_add(&pool->outstanding, 1);
+  if (dequePush(&pool->deques[worker->index], task) == -1) {
+    perror("malloc");
+    atomic_fetch_add(&pool->failures, 1);
+    atomic_fetch_sub(&pool->outstanding, 1);
+    finishChild(task->parent);
+    freeTask(task);
+    return;
+  }
+  atomic_fetch_add(&pool->queued, 1);
+
+  // Wake up a sleeping worker so it can steal the new task
+  if (atomic_load(&pool->idle) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->wakeUp);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+/**
+ * Creates the target directory, then pushes one task per entry of the source
+ * directory.
+ */
+static void scanDirectory(copyWorker *worker, copyTask *task) {
+  copyPool *pool = worker->pool;
+  struct stat sourceAccessControl;
+  struct dirent *entry;
+
+  if (stat(task->source, &sourceAccessControl) == -1) {
+    perror("Error while getting access control of the source directory");
+    atomic_fetch_add(&pool->failures, 1);
+    copyReportDirectory(pool->options, task->source, task->target,
+                        EXIT_FAILURE);
+    return;
+  }
+
+  // Create the target directory before any of its children is written
+  if (mkdir(task->target, 0755) == -1 && errno != EEXIST) {
+    perror("Can't copy the directory");
+    atomic_fetch_add(&pool->failures, 1);
+    copyReportDirectory(pool->options, task->source, task->target,
+                        EXIT_FAILURE);
+    return;
+  }
+
+  copyDir *dir = malloc(sizeof(copyDir));
+  if (!dir) {
+    perror("malloc");
+    atomic_fetch_add(&pool->failures, 1);
+    return;
+  }
+  dir->parent = task->parent;
+  dir->target = task->target;
+  dir->mode = sourceAccessControl.st_mode;
+  atomic_init(&dir->pending, 1);
+  atomic_fetch_add(&task->parent->pending, 1);
+  task->target = NULL; // now owned by `dir`
+
+  acquireFds(pool, 1);
+  DIR *sourceDirectory = opendir(task->source);
+  if (sourceDirectory == NULL) {
+    perror("Can't open input directory");
+    atomic_fetch_add(&pool->failures, 1);
+  }
+
+  // Loop through the entries in the source directory
+  while (sourceDirectory && (entry = readdir(sourceDirectory)) != NULL) {
+    // Skip the "." and ".." entries
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    copyTask *child = malloc(sizeof(copyTask));
+    if (child) {
+      child->source = joinPath(task->source, entry->d_name);
+      child->target = joinPath(dir->target, entry->d_name);
+      child->parent = dir;
+    }
+    if (!child || !child->source || !child->target) {
+      perror("malloc");
+      atomic_fetch_add(&pool->failures, 1);
+      if (child)
+        freeTask(child);
+      continue;
+    }
+
+    // d_type saves a stat for most entries, symbolic links are followed
+    if (entry->d_type == DT_DIR || entry->d_type == DT_REG) {
+      child->isDirectory = entry->d_type == DT_DIR;
+    } else {
+      struct stat fileStat;
+      if (stat(child->source, &fileStat) == -1) {
+        perror("Error retrieving file information");
+        atomic_fetch_add(&pool->failures, 1);
+        freeTask(child);
+        continue;
+      }
+      // Opening a fifo or a device would block or read forever
+      if (!S_ISDIR(fileStat.st_mode) && !S_ISREG(fileStat.st_mode)) {
+        fprintf(stderr, "%s: not a regular file or a directory\n",
+                child->source);
+        atomic_fetch_add(&pool->failures, 1);
+        copyReportFile(pool->options, child->source, child->target,
+                       COPY_NONE, EXIT_FAILURE);
+        freeTask(child);
+        continue;
+      }
+      child->isDirectory = S_ISDIR(fileStat.st_mode);
+    }
+
+    pushTask(worker, child);
+  }
+
+  if (sourceDirectory)
+    closedir(sourceDirectory);
+  releaseFds(pool, 1);
+  copyReportDirectory(pool->options, task->source, dir->target,
+                      sourceDirectory ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  // The scan itself is done, the chmod waits for the children
+  finishChild(dir);
+}
+
+static void copyOneFile(copyWorker *worker, copyTask *task) {
+  copyPool *pool = worker->pool;
+  copyMethod method = COPY_NONE;
+
+  acquireFds(pool, 2);
+  int result = copyFileWithOptions(task->source, task->target, pool->options,
+                                   &method);
+  if (result != EXIT_SUCCESS)
+    atomic_fetch_add(&pool->failures, 1);
+  copyReportFile(pool->options, task->source, task->target, method, result);
+  releaseFds(pool, 2);
+}
+
+static copyTask *findTask(copyWorker *worker) {
+  copyPool *pool = worker->pool;
+  copyTask *task = dequePop(&pool->deques[worker->index]);
+
+  if (!task) {
+    int start = rand_r(&worker->seed) % pool->workerCount;
+    for (int i = 0; i < pool->workerCount && !task; i++) {
+      int victim = (start + i) % pool->workerCount;
+      if (victim != worker->index)
+        task = dequeSteal(&pool->deques[victim]);
+    }
+  }
+
+  if (task)
+    atomic_fetch_sub(&pool->queued, 1);
+  return task;
+}
+
+static void *workerMain(void *argument) {
+  copyWorker *worker = argument;
+  copyPool *pool = worker->pool;
+
+  for (;;) {
+    copyTask *task = findTask(worker);
+
+    if (!task) {
+      // Nothing to steal: sleep until a task is pushed or the copy is over
+      pthread_mutex_lock(&pool->lock);
+      atomic_fetch_add(&pool->idle, 1);
+      while (atomic_load(&pool->queued) == 0 &&
+             atomic_load(&pool->outstanding) > 0)
+        pthread_cond_wait(&pool->wakeUp, &pool->lock);
+      atomic_fetch_sub(&pool->idle, 1);
+      pthread_mutex_unlock(&pool->lock);
+
+      if (atomic_load(&pool->outstanding) == 0)
+        break;
+      continue;
+    }
+
+    if (task->isDirectory)
+      scanDirectory(worker, task);
+    else
+      copyOneFile(worker, task);
+
+    finishChild(task->parent);
+    freeTask(task);
+
+    // Last task of the whole copy: release the sleeping workers
+    if (atomic_fetch_sub(&pool->outstanding, 1) == 1) {
+      pthread_mutex_lock(&pool->lock);
+      pthread_cond_broadcast(&pool->wakeUp);
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+
+  return NULL;
+}
+
+/* Descriptors left to the workers, keeping some for the rest of the shell. */
+static int fdBudget(int workerCount) {
+  struct rlimit limit;
+  int budget = workerCount * FDS_PER_JOB;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    if ((rlim_t)budget > limit.rlim_cur / 2)
+      budget = limit.rlim_cur / 2;
+
+  // Every worker must be able to copy a file at the same time
+  return budget < 2 * workerCount ? 2 * workerCount : budget;
+}
+
+/**
+ * Copies a directory (and its content) from a source path to a target path
+ * with `options->jobs` worker threads. If the source is a regular file, it
+ * is copied like copyDirectoryWithOptions does.
+ */
+int copyDirectoryParallel(const char *source, const char *target,
+                          const copyOptions *options) {
+  struct stat sourceAccessControl;
+  copyPool pool;
+  copyWorker workers[MAX_COPY_JOBS];
+  pthread_t threads[MAX_COPY_JOBS];
+  int workerCount = options->jobs;
+
+  if (stat(source, &sourceAccessControl) == -1) {
+    perror("Error while getting access control of the source directory");
+    return EXIT_FAILURE;
+  }
+  if (!S_ISDIR(sourceAccessControl.st_mode))
+    return copyDirectoryWithOptions(source, target, options);
+
+  if (workerCount > MAX_COPY_JOBS)
+    workerCount = MAX_COPY_JOBS;
+
+  pool.workerCount = workerCount;
+  pool.options = options;
+  atomic_init(&pool.outstanding, 0);
+  atomic_init(&pool.queued, 0);
+  atomic_init(&pool.idle, 0);
+  atomic_init(&pool.failures, 0);
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wakeUp, NULL);
+  pool.openFds = 0;
+  pool.maxFds = fdBudget(workerCount);
+  pthread_mutex_init(&pool.fdLock, NULL);
+  pthread_cond_init(&pool.fdAvailable, NULL);
+
+  pool.deques = malloc(workerCount * sizeof(taskDeque));
+  if (!pool.deques) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < workerCount; i++) {
+    if (dequeInit(&pool.deques[i]) == -1) {
+      perror("malloc");
+      while (i-- > 0)
+        dequeDestroy(&pool.deques[i]);
+      free(pool.deques);
+      return EXIT_FAILURE;
+    }
+    workers[i].pool = &pool;
+    workers[i].index = i;
+    workers[i].seed = i + 1;
+  }
+
+  // Sentinel above the root so that finishChild stops there
+  copyDir root = {.parent = NULL, .target = NULL, .mode = 0};
+  atomic_init(&root.pending, 1);
+
+  copyTask *first = malloc(sizeof(copyTask));
+  if (first) {
+    first->source = strdup(source);
+    first->target = strdup(target);
+    first->isDirectory = 1;
+    first->parent = &root;
+  }
+  if (!first || !first->source || !first->target) {
+    perror("malloc");
+    atomic_fetch_add(&pool.failures, 1);
+    if (first)
+      freeTask(first);
+  } else {
+    pushTask(&workers[0], first);
+  }
+
+  int started = 0;
+  while (started < workerCount &&
+         pthread_create(&threads[started], NULL, workerMain,
+                        &workers[started]) == 0)
+    started++;
+  if (started == 0) // No thread at all: do the work ourselves
+    workerMain(&workers[0]);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < workerCount; i++)
+    dequeDestroy(&pool.deques[i]);
+  free(pool.deques);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.wakeUp);
+  pthread_mutex_destroy(&pool.fdLock);
+  pthread_cond_destroy(&pool.fdAvailable);
+
+  return atomic_load(&pool.failures) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+#include "copy_stats.h"
+#include "crc32c.h"
+
+#include <time.h>
+
+/*
+ * What `cp` prints.
+ *
+ * Printing one line per file makes the terminal the bottleneck of big
+ * copies, so the copy engines only report each file to a collector that
+ * counts files, bytes, methods and errors. On a terminal, a single progress
+ * line on stderr is redrawn at most every PROGRESS_INTERVAL_NS, by whichever
+ * worker thread reports a file first once the interval is over. A summary,
+ * as text or as JSON, is printed at the end. Errors are always printed.
+ */
+
+static long long nowNs(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static double elapsedSeconds(const copyStats *stats) {
+  return (nowNs() - stats->started) / 1e9;
+}
+
+/**
+ * Writes a byte count with a binary unit ("1.5 GiB").
+ */
+static const char *formatBytes(double bytes, char *buffer, size_t size) {
+  static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+  int unit = 0;
+
+  while (bytes >= 1024 && unit < 4) {
+    bytes /= 1024;
+    unit++;
+  }
+  snprintf(buffer, size, unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+  return buffer;
+}
+
+/**
+ * Starts collecting: the clock of the throughput starts now.
+ */
+void copyStatsInit(copyStats *stats, copyReportMode mode) {
+  atomic_init(&stats->bytesWritten, 0);
+  atomic_init(&stats->bytesSkipped, 0);
+  atomic_init(&stats->filesSkipped, 0);
+  atomic_init(&stats->filesVerified, 0);
+  atomic_init(&stats->filesCopied, 0);
+  atomic_init(&stats->directoriesCopied, 0);
+  atomic_init(&stats->failures, 0);
+  for (int i = 0; i < COPY_METHOD_COUNT; i++)
+    atomic_init(&stats->methods[i], 0);
+  stats->mode = mode;
+  stats->progress = mode != COPY_REPORT_QUIET &&
+                    mode != COPY_REPORT_VERBOSE && isatty(STDERR_FILENO);
+  stats->started = nowNs();
+  atomic_init(&stats->nextProgress, stats->started + PROGRESS_INTERVAL_NS);
+  atomic_init(&stats->progressShown, 0);
+}
+
+/**
+ * Redraws the progress line if the interval is over. Only the thread that
+ * moves `nextProgress` forward draws it.
+ */
+static void drawProgress(copyStats *stats) {
+  long long now = nowNs();
+  long long next = atomic_load(&stats->nextProgress);
+  char done[32], rate[32];
+
+  if (now < next || !atomic_compare_exchange_strong(
+                        &stats->nextProgress, &next,
+                        now + PROGRESS_INTERVAL_NS))
+    return;
+
+  long long bytes = atomic_load(&stats->bytesWritten);
+  double seconds = (now - stats->started) / 1e9;
+  fprintf(stderr, "\r\033[K%ld files, %s, %s/s, %ld errors",
+          atomic_load(&stats->filesCopied),
+          formatBytes(bytes, done, sizeof(done)),
+          formatBytes(seconds > 0 ? bytes / seconds : 0, rate, sizeof(rate)),
+          atomic_load(&stats->failures));
+  atomic_store(&stats->progressShown, 1);
+}
+
+/**
+ * Erases the progress line before another message is printed.
+ */
+static void clearProgress(copyStats *stats) {
+  if (atomic_exchange(&stats->progressShown, 0))
+    fprintf(stderr, "\r\033[K");
+}
+
+/**
+ * Counts a file that was copied (or not, if `result` is not EXIT_SUCCESS).
+ */
+void copyReportFile(const copyOptions *options, const char *source,
+                    const char *target, copyMethod method, int result) {
+  copyStats *stats = options->stats;
+
+  if (result != EXIT_SUCCESS) {
+    if (stats) {
+      atomic_fetch_add(&stats->failures, 1);
+      clearProgress(stats);
+    }
+    fprintf(stderr, "Failed to copy %s to %s\n", source, target);
+    return;
+  }
+  if (!stats)
+    return;
+
+  atomic_fetch_add(&stats->filesCopied, 1);
+  atomic_fetch_add(&stats->methods[method], 1);
+  if (stats->mode == COPY_REPORT_VERBOSE)
+    printf("Successfully copied %s to %s (%s)\n", source, target,
+           copyMethodName(method));
+  else if (stats->progress)
+    drawProgress(stats);
+}
+
+/**
+ * Counts a directory whose entries have all been handed to the copy.
+ */
+void copyReportDirectory(const copyOptions *options, const char *source,
+                         const char *target, int result) {
+  copyStats *stats = options->stats;
+
+  if (result != EXIT_SUCCESS) {
+    if (stats) {
+      atomic_fetch_add(&stats->failures, 1);
+      clearProgress(stats);
+    }
+    fprintf(stderr, "Failed to copy %s to %s\n", source, target);
+    return;
+  }
+  if (!stats)
+    return;
+
+  atomic_fetch_add(&stats->directoriesCopied, 1);
+  if (stats->mode == COPY_REPORT_VERBOSE)
+    printf("Successfully copied %s to %s\n", source, target);
+}
+
+/**
+ * Prints the summary of the copy: one line of text, or a JSON object with
+ * `--json`. Nothing in quiet mode.
+ */
+void copyStatsSummary(copyStats *stats, const copyOptions *options) {
+  double seconds = elapsedSeconds(stats);
+  long long written = atomic_load(&stats->bytesWritten);
+  double rate = seconds > 0 ? written / seconds : 0;
+  char size[32], speed[32];
+
+  clearProgress(stats);
+  if (stats->mode == COPY_REPORT_QUIET)
+    return;
+
+  if (stats->mode == COPY_REPORT_JSON) {
+    printf("{\"files\": %ld, \"directories\": %ld, \"errors\": %ld, "
+           "\"bytes_written\": %lld, \"bytes_skipped\": %lld, "
+           "\"files_unchanged\": %ld, \"files_verified\": %ld, "
+           "\"seconds\": %.3f, \"bytes_per_sec\": %.0f, \"methods\": {",
+           atomic_load(&stats->filesCopied),
+           atomic_load(&stats->directoriesCopied),
+           atomic_load(&stats->failures), written,
+           (long long)atomic_load(&stats->bytesSkipped),
+           atomic_load(&stats->filesSkipped),
+           atomic_load(&stats->filesVerified), seconds, rate);
+    for (int i = 0, first = 1; i < COPY_METHOD_COUNT; i++) {
+      long count = atomic_load(&stats->methods[i]);
+      if (!count)
+        continue;
+      printf("%s\"%s\": %ld", first ? "" : ", ", copyMethodName(i), count);
+      first = 0;
+    }
+    printf("}}\n");
+    return;
+  }
+
+  printf("%ld files, %ld directories, %s in %.2f s (%s/s), %ld errors",
+         atomic_load(&stats->filesCopied),
+         atomic_load(&stats->directoriesCopied),
+         formatBytes(written, size, sizeof(size)), seconds,
+         formatBytes(rate, speed, sizeof(speed)),
+         atomic_load(&stats->failures));
+  if (options->incremental)
+    printf(", %lld bytes skipped (%ld unchanged files)",
+           (long long)atomic_load(&stats->bytesSkipped),
+           atomic_load(&stats->filesSkipped));
+  if (options->verify)
+    printf(", %ld verified (crc32c, %s)", atomic_load(&stats->filesVerified),
+           crc32cImplementation());
+  printf("\n");
+}
@@ -0,0 +1,467 @@
+#include "copy_uring.h"
+#include "copy_stats.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * io_uring backend for trees made of small files.
+ *
+ * A batch of files goes through the same stages as copyFile (stat, open,
+ * read, write, close), but each stage is submitted for the whole batch with
+ * a single io_uring_enter instead of one system call per file. Files that are
+ * too big to fit in one read are handed to copyFileWithOptions. When io_uring
+ * is missing (old kernel, seccomp filter...) every file goes through the
+ * synchronous path.
+ */
+
+typedef struct uringRing {
+  int fd;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned pending; /* requests prepared and not submitted yet */
+} uringRing;
+
+/* State of one file of the batch. */
+typedef struct uringFile {
+  const char *source;
+  const char *target;
+  struct statx sourceStat;
+  struct statx targetStat;
+  int targetExists;
+  int sourceDescriptor;
+  int targetDescriptor;
+  char *buffer;
+  ssize_t length; /* bytes read from the source */
+  int failed;
+  int synchronous; /* left to copyFileWithOptions */
+  int unchanged;   /* incremental copy: nothing to do */
+} uringFile;
+
+/* What a completion refers to, stored in the low bit of user_data. */
+enum { URING_SOURCE = 0, URING_TARGET = 1 };
+
+static uringRing ring;
+static int ringState; /* 0 = not tried yet, 1 = ready, -1 = unavailable */
+static char *buffers; /* URING_BATCH buffers of URING_SMALL_FILE bytes */
+
+/**
+ * Checks that the kernel knows every operation used by the copy.
+ */
+static int probeOperations(int fd) {
+  static const int needed[] = {IORING_OP_STATX, IORING_OP_OPENAT,
+                               IORING_OP_READ, IORING_OP_WRITE,
+                               IORING_OP_CLOSE};
+  size_t size = sizeof(struct io_uring_probe) +
+                IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  int supported = 1;
+
+  if (!probe)
+    return 0;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+              IORING_OP_LAST) < 0) {
+    free(probe);
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++)
+    if (needed[i] > probe->last_op ||
+        !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+      supported = 0;
+  free(probe);
+  return supported;
+}
+
+/**
+ * Creates the ring and maps its submission and completion queues.
+ */
+static int ringSetup(void) {
+  struct io_uring_params params;
+  void *sqPointer, *cqPointer;
+
+  memset(&params, 0, sizeof(params));
+  ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ring.fd < 0)
+    return -1;
+
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+
+  sqPointer = mmap(NULL, sqSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (sqPointer == MAP_FAILED)
+    goto fail;
+  cqPointer = sqPointer;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    cqPointer = mmap(NULL, cqSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (cqPointer == MAP_FAILED)
+      goto fail;
+  }
+  ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED)
+    goto fail;
+
+  ring.sqHead = (unsigned *)((char *)sqPointer + params.sq_off.head);
+  ring.sqTail = (unsigned *)((char *)sqPointer + params.sq_off.tail);
+  ring.sqMask = (unsigned *)((char *)sqPointer + params.sq_off.ring_mask);
+  ring.sqArray = (unsigned *)((char *)sqPointer + params.sq_off.array);
+  ring.cqHead = (unsigned *)((char *)cqPointer + params.cq_off.head);
+  ring.cqTail = (unsigned *)((char *)cqPointer + params.cq_off.tail);
+  ring.cqMask = (unsigned *)((char *)cqPointer + params.cq_off.ring_mask);
+  ring.cqes =
+      (struct io_uring_cqe *)((char *)cqPointer + params.cq_off.cqes);
+  ring.pending = 0;
+
+  if (!probeOperations(ring.fd))
+    goto fail;
+
+  buffers = malloc((size_t)URING_BATCH * URING_SMALL_FILE);
+  if (!buffers)
+    goto fail;
+  return 0;
+
+fail:
+  // The mappings go away with the process, only the descriptor matters
+  close(ring.fd);
+  return -1;
+}
+
+/**
+ * Tells whether the io_uring backend can be used, setting it up on the first
+ * call.
+ */
+int uringAvailable(void) {
+  if (ringState == 0) {
+    ringState = ringSetup() == 0 ? 1 : -1;
+    if (ringState == -1)
+      fprintf(stderr, "cp: io_uring unavailable, using the sync backend\n");
+  }
+  return ringState == 1;
+}
+
+/* Reserves the next submission entry. */
+static struct io_uring_sqe *nextRequest(int index, int kind) {
+  unsigned tail = *ring.sqTail + ring.pending;
+  unsigned slot = tail & *ring.sqMask;
+  struct io_uring_sqe *sqe = &ring.sqes[slot];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = ((__u64)index << 1) | kind;
+  ring.sqArray[slot] = slot;
+  ring.pending++;
+  return sqe;
+}
+
+/**
+ * Submits the prepared requests, waits for all of them and gives each result
+ * to `complete`.
+ */
+static void submitAndWait(uringFile *files,
+                          void (*complete)(uringFile *, int, int)) {
+  unsigned toSubmit = ring.pending;
+  unsigned remaining = ring.pending;
+
+  __atomic_store_n(ring.sqTail, *ring.sqTail + ring.pending,
+                   __ATOMIC_RELEASE);
+  ring.pending = 0;
+
+  while (remaining > 0) {
+    if (syscall(__NR_io_uring_enter, ring.fd, toSubmit, remaining,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+    toSubmit = 0;
+
+    unsigned head = *ring.cqHead;
+    unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, remaining--) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+      complete(&files[cqe->user_data >> 1], cqe->user_data & 1, cqe->res);
+    }
+    __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+  }
+}
+
+static void reportError(uringFile *file, const char *message, int error) {
+  fprintf(stderr, "%s: %s\n", message, strerror(error));
+  file->failed = 1;
+}
+
+static void statDone(uringFile *file, int kind, int result) {
+  if (kind == URING_TARGET) {
+    file->targetExists = result == 0;
+  } else if (result < 0) {
+    reportError(file, "Error while getting access control of the source file",
+                -result);
+  } else if (!S_ISREG(file->sourceStat.stx_mode) ||
+             file->sourceStat.stx_size >= URING_SMALL_FILE ||
+             file->sourceStat.stx_nlink > 1) {
+    // Hard links are recreated by copyFileWithOptions
+    file->synchronous = 1;
+  }
+}
+
+static void openDone(uringFile *file, int kind, int result) {
+  if (result < 0) {
+    reportError(file,
+                kind == URING_SOURCE ? "Can't open the source file"
+                                     : "You can't write the target file",
+                -result);
+  } else if (kind == URING_SOURCE) {
+    file->sourceDescriptor = result;
+  } else {
+    file->targetDescriptor = result;
+  }
+}
+
+static void readDone(uringFile *file, int kind, int result) {
+  (void)kind;
+  if (result < 0) {
+    reportError(file, "Error during reading from source file", -result);
+    return;
+  }
+
+  // Finish a short read synchronously (FUSE, NFS...). Reading less than the
+  // stat'ed size only at the end of the file, if it was truncated meanwhile.
+  file->length = result;
+  while (file->length < (ssize_t)file->sourceStat.stx_size) {
+    ssize_t n = pread(file->sourceDescriptor, file->buffer + file->length,
+                      file->sourceStat.stx_size - file->length, file->length);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1) {
+      reportError(file, "Error during reading from source file", errno);
+      return;
+    }
+    if (n == 0)
+      break;
+    file->length += n;
+  }
+}
+
+static void writeDone(uringFile *file, int kind, int result) {
+  (void)kind;
+  if (result < 0) {
+    reportError(file, "Error during writing to target file", -result);
+    return;
+  }
+
+  // Finish a short write synchronously
+  for (ssize_t done = result; done < file->length;) {
+    ssize_t written = pwrite(file->targetDescriptor, file->buffer + done,
+                             file->length - done, done);
+    if (written == -1 && errno != EINTR) {
+      reportError(file, "Error during writing to target file", errno);
+      return;
+    }
+    if (written > 0)
+      done += written;
+  }
+}
+
+static void closeDone(uringFile *file, int kind, int result) {
+  if (result < 0 && kind == URING_TARGET)
+    reportError(file, "Error while closing the target file", -result);
+}
+
+/* Files that are still copied through the ring at a given stage. */
+static int inRing(uringFile *file) {
+  return !file->failed && !file->synchronous && !file->unchanged;
+}
+
+/* Same test as copyFileWithOptions for incremental copies. */
+static int isUnchanged(uringFile *file) {
+  return file->targetExists && S_ISREG(file->targetStat.stx_mode) &&
+         file->targetStat.stx_size == file->sourceStat.stx_size &&
+         file->targetStat.stx_mtime.tv_sec ==
+             file->sourceStat.stx_mtime.tv_sec &&
+         file->targetStat.stx_mtime.tv_nsec ==
+             file->sourceStat.stx_mtime.tv_nsec;
+}
+
+/**
+ * Copies `count` files (at most URING_BATCH) and reports each one like
+ * copyDirectory does. Returns the number of files that failed.
+ */
+int uringCopyFiles(const char **sources, const char **targets, int count,
+                   const copyOptions *options) {
+  uringFile files[URING_BATCH];
+  int failures = 0;
+  mode_t mask = umask(0);
+
+  umask(mask);
+  if (count > URING_BATCH)
+    count = URING_BATCH;
+
+  for (int i = 0; i < count; i++) {
+    files[i].source = sources[i];
+    files[i].target = targets[i];
+    files[i].targetExists = 0;
+    files[i].sourceDescriptor = files[i].targetDescriptor = -1;
+    files[i].length = 0;
+    files[i].failed = 0;
+    files[i].unchanged = 0;
+    // Synchronous fallback for everything when the ring is unusable
+    files[i].synchronous = !uringAvailable();
+  }
+
+  if (uringAvailable()) {
+    // Stage 1: stat the sources, and the targets to know their current mode
+    // (and whether they changed, for incremental copies)
+    for (int i = 0; i < count; i++) {
+      struct io_uring_sqe *sqe = nextRequest(i, URING_SOURCE);
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (__u64)(uintptr_t)files[i].source;
+      sqe->len = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_SIZE |
+                 STATX_ATIME | STATX_MTIME;
+      sqe->off = (__u64)(uintptr_t)&files[i].sourceStat;
+
+      sqe = nextRequest(i, URING_TARGET);
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (__u64)(uintptr_t)files[i].target;
+      sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+      sqe->off = (__u64)(uintptr_t)&files[i].targetStat;
+    }
+    submitAndWait(files, statDone);
+
+    for (int i = 0; i < count; i++) {
+      if (options->incremental && inRing(&files[i]) &&
+          isUnchanged(&files[i])) {
+        files[i].unchanged = 1;
+        copyStatsCount(options, 0, files[i].sourceStat.stx_size);
+      }
+    }
+
+    // Stage 2: open both sides
+    for (int i = 0; i < count; i++) {
+      if (!inRing(&files[i]))
+        continue;
+      struct io_uring_sqe *sqe = nextRequest(i, URING_SOURCE);
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (__u64)(uintptr_t)files[i].source;
+      sqe->open_flags = O_RDONLY;
+
+      sqe = nextRequest(i, URING_TARGET);
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (__u64)(uintptr_t)files[i].target;
+      sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+      sqe->len = 0644;
+    }
+    submitAndWait(files, openDone);
+
+    // Stage 3: read each file in one request
+    for (int i = 0; i < count; i++) {
+      files[i].buffer = buffers + (size_t)i * URING_SMALL_FILE;
+      if (!inRing(&files[i]) || files[i].sourceDescriptor == -1 ||
+          files[i].targetDescriptor == -1)
+        continue;
+      struct io_uring_sqe *sqe = nextRequest(i, URING_SOURCE);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = files[i].sourceDescriptor;
+      sqe->addr = (__u64)(uintptr_t)files[i].buffer;
+      sqe->len = URING_SMALL_FILE;
+      sqe->off = 0;
+    }
+    submitAndWait(files, readDone);
+
+    // Stage 4: write it back
+    for (int i = 0; i < count; i++) {
+      if (!inRing(&files[i]) || files[i].length == 0)
+        continue;
+      struct io_uring_sqe *sqe = nextRequest(i, URING_TARGET);
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->fd = files[i].targetDescriptor;
+      sqe->addr = (__u64)(uintptr_t)files[i].buffer;
+      sqe->len = files[i].length;
+      sqe->off = 0;
+    }
+    submitAndWait(files, writeDone);
+
+    for (int i = 0; i < count; i++) {
+      if (!inRing(&files[i]))
+        continue;
+
+      // The file grew since the stat: copy the rest synchronously
+      if (files[i].length == URING_SMALL_FILE) {
+        copyMethod method;
+        if (lseek(files[i].sourceDescriptor, files[i].length, SEEK_SET) ==
+                -1 ||
+            lseek(files[i].targetDescriptor, files[i].length, SEEK_SET) ==
+                -1 ||
+            copyData(files[i].sourceDescriptor, files[i].targetDescriptor, 0,
+                     &method) != EXIT_SUCCESS)
+          files[i].failed = 1;
+      }
+
+      // Copy the access permissions, unless open() already gave them
+      mode_t mode = files[i].sourceStat.stx_mode & 07777;
+      mode_t current = files[i].targetExists
+                           ? (files[i].targetStat.stx_mode & 07777)
+                           : (0644 & ~mask);
+      if (mode != current)
+        fchmod(files[i].targetDescriptor, mode);
+
+      if (!files[i].failed) {
+        copyStatsCount(options, files[i].length, 0);
+
+        // Keep the modification time so that the next run can skip the file
+        if (options->incremental) {
+          struct timespec times[2] = {
+              {files[i].sourceStat.stx_atime.tv_sec,
+               files[i].sourceStat.stx_atime.tv_nsec},
+              {files[i].sourceStat.stx_mtime.tv_sec,
+               files[i].sourceStat.stx_mtime.tv_nsec}};
+          futimens(files[i].targetDescriptor, times);
+        }
+      }
+    }
+
+    // Stage 5: close everything that was opened
+    for (int i = 0; i < count; i++) {
+      if (files[i].sourceDescriptor != -1) {
+        struct io_uring_sqe *sqe = nextRequest(i, URING_SOURCE);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = files[i].sourceDescriptor;
+      }
+      if (files[i].targetDescriptor != -1) {
+        struct io_uring_sqe *sqe = nextRequest(i, URING_TARGET);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = files[i].targetDescriptor;
+      }
+    }
+    submitAndWait(files, closeDone);
+  }
+
+  for (int i = 0; i < count; i++) {
+    copyMethod method = files[i].unchanged ? COPY_UNCHANGED : COPY_URING;
+
+    if (files[i].synchronous && !files[i].failed)
+      files[i].failed = copyFileWithOptions(files[i].source, files[i].target,
+                                            options, &method) != EXIT_SUCCESS;
+
+    if (files[i].failed)
+      failures++;
+    copyReportFile(options, files[i].source, files[i].target, method,
+                   files[i].failed ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  return failures;
+}
@@ -0,0 +1,112 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli), the checksum of `cp --verify`.
+ *
+ * x86 processors with SSE4.2 compute it with the crc32 instruction, 8 bytes
+ * at a time. Elsewhere a slicing-by-8 table does the same with 8 lookups per
+ * 8 bytes. The implementation is chosen once, on first use. Like zlib's
+ * crc32(), crc32cUpdate() starts from 0 and can be fed block by block.
+ */
+
+typedef uint32_t (*crc32cFunction)(uint32_t crc, const unsigned char *data,
+                                   size_t length);
+
+static uint32_t table[8][256];
+static crc32cFunction implementation;
+static const char *implementationName;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/**
+ * Slicing-by-8: table[k][b] is the CRC of byte b followed by k zero bytes.
+ */
+static uint32_t crc32cTable(uint32_t crc, const unsigned char *data,
+                            size_t length) {
+  uint64_t word;
+
+  while (length && ((uintptr_t)data & 7)) {
+    crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    length--;
+  }
+  while (length >= 8) {
+    memcpy(&word, data, 8); // Little-endian, as every target of the shell
+    word ^= crc;
+    crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+          table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+          table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+          table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+    data += 8;
+    length -= 8;
+  }
+  while (length--)
+    crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE4.2 crc32 instruction, one 64-bit word per instruction.
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32cHardware(uint32_t crc, const unsigned char *data, size_t length) {
+  uint64_t value = crc, word;
+
+  while (length && ((uintptr_t)data & 7)) {
+    value = _mm_crc32_u8(value, *data++);
+    length--;
+  }
+  while (length >= 8) {
+    memcpy(&word, data, 8);
+    value = _mm_crc32_u64(value, word);
+    data += 8;
+    length -= 8;
+  }
+  while (length--)
+    value = _mm_crc32_u8(value, *data++);
+  return value;
+}
+#endif
+
+static void crc32cInit(void) {
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+    table[0][b] = crc;
+  }
+  for (int k = 1; k < 8; k++)
+    for (int b = 0; b < 256; b++)
+      table[k][b] = table[0][table[k - 1][b] & 0xff] ^ (table[k - 1][b] >> 8);
+
+  implementation = crc32cTable;
+  implementationName = "table";
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    implementation = crc32cHardware;
+    implementationName = "sse4.2";
+  }
+#endif
+}
+
+/**
+ * Continues the CRC32C `crc` (0 for a new one) over `length` bytes.
+ */
+uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t length) {
+  pthread_once(&once, crc32cInit);
+  return ~implementation(~crc, data, length);
+}
+
+/**
+ * Returns the name of the implementation in use, for messages.
+ */
+const char *crc32cImplementation(void) {
+  pthread_once(&once, crc32cInit);
+  return implementationName;
+}
@@ -0,0 +1,463 @@
+#include "glob_expand.h"
+#include "terminal.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Pathname expansion.
+ *
+ * A pattern is split at the slashes and each component holding *, ? or
+ * [...] is compiled once into a list of operations. Directories are read with
+ * getdents64, whose d_type tells the subdirectories apart without a stat
+ * (only symbolic links and file systems that do not fill d_type need one).
+ * The listings are cached until the parser is done with the line, so the
+ * words of a command that glob in the same directory read it once. Like sh,
+ * dot files only match a pattern that starts with a literal '.', . and .. are
+ * never listed, and the results are sorted (by byte values, not by locale).
+ */
+
+typedef enum { MATCH_CHAR, MATCH_ANY, MATCH_STAR, MATCH_CLASS } match_type;
+
+typedef struct match_op {
+  match_type type;
+  unsigned char c;        /* MATCH_CHAR */
+  unsigned char set[32];  /* MATCH_CLASS: bit per byte value */
+} match_op;
+
+typedef struct component {
+  char *text;    /* unescaped name when the component has no pattern */
+  match_op *ops; /* compiled pattern, NULL for a plain name */
+  int count;
+  int dot;       /* the pattern starts with a literal '.' */
+} component;
+
+typedef struct listing {
+  char *dir;           /* path given to open(), "." for the current one */
+  char *names;         /* names, NUL-terminated, one after the other */
+  uint32_t *offsets;   /* start of each name in names */
+  unsigned char *types; /* d_type of each name */
+  size_t count;
+  int busy;             /* walks using it: not to be replaced */
+  int owned;            /* not in the cache, freed after the walk */
+} listing;
+
+static listing cache[GLOB_CACHE_DIRS];
+static int cache_next; /* slot replaced when the cache is full */
+
+static char **results;
+static size_t result_count;
+static size_t result_capacity;
+
+/* Finds the ']' closing the bracket expression at p, or returns NULL if it
+   is a plain '['. A ']' right after "[" or "[!" belongs to the set.  */
+static const char *class_end(const char *p, const char *end) {
+  const char *q = p + 1;
+
+  if (q < end && (*q == '!' || *q == '^'))
+    q++;
+  if (q < end && *q == ']')
+    q++;
+  for (; q < end; q++) {
+    if (*q == '\\' && q + 1 < end)
+      q++;
+    else if (*q == ']')
+      return q;
+  }
+  return NULL;
+}
+
+/* Tells whether a pattern has an active *, ? or [...] outside escapes.  */
+static int has_magic(const char *p, const char *end) {
+  for (; p < end; p++) {
+    if (*p == '\\' && p + 1 < end)
+      p++;
+    else if (*p == '*' || *p == '?' || (*p == '[' && class_end(p, end)))
+      return 1;
+  }
+  return 0;
+}
+
+/* Compiles the bracket expression between '[' and `close`.  */
+static void compile_class(const char *p, const char *close, match_op *op) {
+  int negate = 0, first = 1;
+  unsigned char low, high;
+  int c;
+
+  memset(op->set, 0, sizeof(op->set));
+  op->type = MATCH_CLASS;
+  if (*p == '!' || *p == '^') {
+    negate = 1;
+    p++;
+  }
+  while (p < close && (*p != ']' || first)) {
+    first = 0;
+    if (*p == '\\')
+      p++;
+    low = high = *p++;
+    if (p + 1 < close && *p == '-') {
+      p++;
+      if (*p == '\\')
+        p++;
+      high = *p++;
+    }
+    for (c = low; c <= high; c++)
+      op->set[c >> 3] |= 1 << (c & 7);
+  }
+  if (negate)
+    for (c = 0; c < 32; c++)
+      op->set[c] = ~op->set[c];
+}
+
+/* Compiles the component [p, end) into the arena.  */
+static void compile(arena *a, component *comp, const char *p, const char *end) {
+  const char *close;
+  match_op *op;
+  char *out;
+
+  comp->count = 0;
+  comp->dot = *p == '.' || (*p == '\\' && p[1] == '.');
+  if (!has_magic(p, end)) {
+    comp->ops = NULL;
+    comp->text = out = arena_alloc(a, end - p + 1);
+    for (; p < end; p++) {
+      if (*p == '\\' && p + 1 < end)
+        p++;
+      *out++ = *p;
+    }
+    *out = '\0';
+    return;
+  }
+
+  comp->ops = op = arena_alloc(a, (end - p) * sizeof(match_op));
+  while (p < end) {
+    if (*p == '*') {
+      /* Consecutive stars are one.  */
+      if (!comp->count || op[-1].type != MATCH_STAR) {
+        op->type = MATCH_STAR;
+        op++, comp->count++;
+      }
+      p++;
+      continue;
+    }
+    if (*p == '?') {
+      op->type = MATCH_ANY;
+      p++;
+    } else if (*p == '[' && (close = class_end(p, end))) {
+      compile_class(p + 1, close, op);
+      p = close + 1;
+    } else {
+      if (*p == '\\' && p + 1 < end)
+        p++;
+      op->type = MATCH_CHAR;
+      op->c = *p++;
+    }
+    op++, comp->count++;
+  }
+}
+
+static int match_one(const match_op *op, unsigned char c) {
+  switch (op->type) {
+  case MATCH_CHAR:
+    return op->c == c;
+  case MATCH_ANY:
+    return 1;
+  case MATCH_CLASS:
+    return op->set[c >> 3] >> (c & 7) & 1;
+  default:
+    return 0;
+  }
+}
+
+/* Matches a name against a compiled component. A failed match after a star
+   only resumes from that star, so the time is bounded by the product of the
+   lengths.  */
+static int match(const component *comp, const char *s) {
+  const match_op *ops = comp->ops;
+  const char *resume = NULL;
+  int i = 0, star = -1;
+
+  if (*s == '.' && !comp->dot)
+    return 0;
+  while (*s) {
+    if (i < comp->count && ops[i].type == MATCH_STAR) {
+      star = ++i;
+      resume = s;
+    } else if (i < comp->count && match_one(&ops[i], *s)) {
+      i++;
+      s++;
+    } else if (star >= 0) {
+      i = star;
+      s = ++resume;
+    } else
+      return 0;
+  }
+  while (i < comp->count && ops[i].type == MATCH_STAR)
+    i++;
+  return i == comp->count;
+}
+
+static void free_listing(listing *l) {
+  free(l->dir);
+  free(l->names);
+  free(l->offsets);
+  free(l->types);
+  memset(l, 0, sizeof(*l));
+}
+
+/* Ends a walk of a listing, which is dropped if it is not cached.  */
+static void release_listing(listing *l) {
+  if (--l->busy == 0 && l->owned) {
+    free_listing(l);
+    free(l);
+  }
+}
+
+/* Forgets the cached listings: the directories may change once the command
+   runs.  */
+void glob_cache_clear() {
+  int i;
+
+  for (i = 0; i < GLOB_CACHE_DIRS; i++)
+    if (cache[i].dir)
+      free_listing(&cache[i]);
+  cache_next = 0;
+}
+
+/* Reads a directory with getdents64. Returns NULL if it cannot be read.  */
+static listing *read_dir(const char *dir) {
+  size_t names_size = 0, names_capacity = 0, capacity = 0;
+  listing *l;
+  char *buffer;
+  long n, pos;
+  int fd, i, owned;
+
+  for (i = 0; i < GLOB_CACHE_DIRS; i++)
+    if (cache[i].dir && strcmp(cache[i].dir, dir) == 0)
+      return &cache[i];
+
+  fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  buffer = malloc(GLOB_BUFFER);
+  if (!buffer) {
+    close(fd);
+    return NULL;
+  }
+
+  /* Replace a listing no walk is using. When every one is in use, the
+     pattern is deeper than the cache: this listing is not kept.  */
+  for (l = NULL, i = 0; i < GLOB_CACHE_DIRS && !l; i++) {
+    if (!cache[cache_next].busy)
+      l = &cache[cache_next];
+    cache_next = (cache_next + 1) % GLOB_CACHE_DIRS;
+  }
+  if (l)
+    free_listing(l);
+  else if ((l = calloc(1, sizeof(listing))))
+    l->owned = 1;
+  else
+    goto fail_early;
+  l->dir = strdup(dir);
+
+  while ((n = getdents64(fd, buffer, GLOB_BUFFER)) > 0) {
+    for (pos = 0; pos < n;) {
+      struct dirent64 *entry = (struct dirent64 *)(buffer + pos);
+      size_t length = strlen(entry->d_name) + 1;
+      pos += entry->d_reclen;
+      if (entry->d_name[0] == '.' &&
+          (!entry->d_name[1] ||
+           (entry->d_name[1] == '.' && !entry->d_name[2])))
+        continue;
+
+      if (names_size + length > names_capacity) {
+        names_capacity = names_capacity ? names_capacity * 2 : 4096;
+        char *grown = realloc(l->names, names_capacity);
+        if (!grown)
+          goto fail;
+        l->names = grown;
+      }
+      if (l->count == capacity) {
+        capacity = capacity ? capacity * 2 : GLOB_RESULTS_MIN;
+        uint32_t *offsets = realloc(l->offsets, capacity * sizeof(uint32_t));
+        if (offsets)
+          l->offsets = offsets;
+        unsigned char *types = realloc(l->types, capacity);
+        if (types)
+          l->types = types;
+        if (!offsets || !types)
+          goto fail;
+      }
+      memcpy(l->names + names_size, entry->d_name, length);
+      l->offsets[l->count] = names_size;
+      l->types[l->count] = entry->d_type;
+      l->count++;
+      names_size += length;
+    }
+  }
+  free(buffer);
+  close(fd);
+  return l;
+
+fail:
+  owned = l->owned;
+  free_listing(l);
+  if (owned)
+    free(l);
+fail_early:
+  perror("glob");
+  free(buffer);
+  close(fd);
+  return NULL;
+}
+
+static void add_result(arena *a, const char *path, size_t length) {
+  char *copy;
+
+  if (result_count == result_capacity) {
+    size_t capacity = result_capacity ? result_capacity * 2 : GLOB_RESULTS_MIN;
+    char **grown = realloc(results, capacity * sizeof(char *));
+    if (!grown)
+      return;
+    results = grown;
+    result_capacity = capacity;
+  }
+  copy = arena_strndup(a, path, length);
+  if (copy)
+    results[result_count++] = copy;
+}
+
+typedef struct glob_state {
+  arena *arena;
+  component *components;
+  int count;
+  int dir_only; /* the pattern ends with a slash */
+  char *path;   /* path being built */
+  size_t capacity;
+} glob_state;
+
+/* Appends a name to the path of length `length`. Returns the new length, or
+   0 if there is no memory.  */
+static size_t join(glob_state *st, size_t length, const char *name) {
+  size_t name_length = strlen(name);
+
+  if (length + name_length + 3 > st->capacity) {
+    size_t capacity = (length + name_length + 3) * 2;
+    char *grown = realloc(st->path, capacity);
+    if (!grown)
+      return 0;
+    st->path = grown;
+    st->capacity = capacity;
+  }
+  if (length && st->path[length - 1] != '/')
+    st->path[length++] = '/';
+  memcpy(st->path + length, name, name_length + 1);
+  return length + name_length;
+}
+
+static int is_dir(const char *path, unsigned char type) {
+  struct stat st;
+
+  if (type == DT_DIR)
+    return 1;
+  if (type != DT_LNK && type != DT_UNKNOWN)
+    return 0;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Matches component k in the directory st->path[0, length).  */
+static void walk(glob_state *st, size_t length, int k) {
+  const component *comp = &st->components[k];
+  int last = k == st->count - 1;
+  struct stat info;
+  size_t i, joined;
+  listing *l;
+
+  if (!comp->ops) {
+    if (!(joined = join(st, length, comp->text)))
+      return;
+    if (!last)
+      walk(st, joined, k + 1);
+    else if (st->dir_only ? stat(st->path, &info) == 0 && S_ISDIR(info.st_mode)
+                          : lstat(st->path, &info) == 0)
+      add_result(st->arena, st->path, joined);
+    return;
+  }
+
+  if (length)
+    st->path[length] = '\0';
+  l = read_dir(length ? st->path : ".");
+  if (!l)
+    return;
+  l->busy++;
+  for (i = 0; i < l->count; i++) {
+    const char *name = l->names + l->offsets[i];
+    if (!match(comp, name))
+      continue;
+    if (!(joined = join(st, length, name)))
+      break;
+    if ((!last || st->dir_only) && !is_dir(st->path, l->types[i]))
+      continue;
+    if (!last)
+      walk(st, joined, k + 1);
+    else
+      add_result(st->arena, st->path, joined);
+  }
+  release_listing(l);
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Expands a pattern where quoted characters are escaped with '\'. The
+   matches are allocated in the arena, the array is reused by the next call.
+   Returns NULL if nothing matches or the word is no pattern.  */
+char **glob_expand(arena *a, const char *pattern, size_t *count) {
+  const char *p, *end = pattern + strlen(pattern);
+  glob_state st = {a, NULL, 0, 0, NULL, 0};
+  size_t i, suffix;
+
+  *count = result_count = 0;
+  if (!has_magic(pattern, end))
+    return NULL;
+
+  st.components = arena_alloc(a, (end - pattern + 1) * sizeof(component));
+  for (p = pattern; p < end;) {
+    const char *slash = p;
+    while (slash < end && *slash != '/')
+      slash += *slash == '\\' && slash + 1 < end ? 2 : 1;
+    if (slash > p)
+      compile(a, &st.components[st.count++], p, slash);
+    p = slash + 1;
+  }
+  st.dir_only = end > pattern && end[-1] == '/';
+
+  st.capacity = 256;
+  st.path = malloc(st.capacity);
+  if (!st.path)
+    return NULL;
+  st.path[0] = '/';
+  if (st.count)
+    walk(&st, *pattern == '/', 0);
+  free(st.path);
+
+  /* A trailing slash is kept, like sh does.  */
+  if (st.dir_only)
+    for (i = 0; i < result_count; i++) {
+      suffix = strlen(results[i]);
+      char *slashed = arena_alloc(a, suffix + 2);
+      memcpy(slashed, results[i], suffix);
+      memcpy(slashed + suffix, "/", 2);
+      results[i] = slashed;
+    }
+
+  qsort(results, result_count, sizeof(char *), compare_paths);
+  *count = result_count;
+  return result_count ? results : NULL;
+}
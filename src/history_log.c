@@ -0,0 +1,373 @@
+#include "history_log.h"
+#include "terminal.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Persistent history.
+ *
+ * Every command line is appended to a log, one line per entry, by a single
+ * write on a descriptor opened with O_APPEND: shells running at the same time
+ * can share the file without locking, their entries never interleave. At
+ * startup the log is mapped, not read, and only its last HISTORY_LOAD entries
+ * are handed to readline for the arrow keys, so the startup time does not
+ * depend on the size of the log.
+ *
+ * The searches (Ctrl-R, M-p and the `history` builtin) use an index built the
+ * first time it is needed, and extended when the log grows, also with the
+ * entries of the other shells. It gives the offset of each entry and a 64-bit
+ * signature of the bytes it contains: an entry is only compared with the
+ * query when its signature has every bit of the query's.
+ */
+
+typedef struct history_entry {
+  size_t offset;      /* of the entry in the log */
+  uint64_t signature; /* bit (c & 63) is set for each byte c of the entry */
+} history_entry;
+
+static int log_fd = -1;
+static char *log_map;     /* the log, mapped up to log_mapped */
+static size_t log_mapped;
+
+static history_entry *entries;
+static long entry_count;
+static long entry_capacity;
+static size_t indexed; /* bytes of the log covered by the index */
+
+static uint64_t signature(const char *s, size_t length) {
+  uint64_t bits = 0;
+
+  while (length--)
+    bits |= 1ull << ((unsigned char)*s++ & 63);
+  return bits;
+}
+
+/* Maps the part of the log written since the last call, by this shell or by
+   another one.  */
+static int log_refresh() {
+  struct stat st;
+  char *map;
+
+  if (log_fd < 0 || fstat(log_fd, &st) < 0)
+    return -1;
+  if ((size_t)st.st_size < log_mapped) {
+    /* The log was truncated: start over.  */
+    munmap(log_map, log_mapped);
+    log_map = NULL;
+    log_mapped = indexed = 0;
+    entry_count = 0;
+  }
+  if ((size_t)st.st_size == log_mapped)
+    return 0;
+
+  if (log_map)
+    map = mremap(log_map, log_mapped, st.st_size, MREMAP_MAYMOVE);
+  else
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, log_fd, 0);
+  if (map == MAP_FAILED) {
+    perror("history");
+    return -1;
+  }
+  log_map = map;
+  log_mapped = st.st_size;
+  return 0;
+}
+
+/* Indexes the complete entries of the log that are not indexed yet.  */
+static void index_update() {
+  char *line, *end;
+
+  log_refresh();
+  while (indexed < log_mapped) {
+    line = log_map + indexed;
+    end = memchr(line, '\n', log_mapped - indexed);
+    if (!end)
+      break; /* still being written */
+    if (entry_count == entry_capacity) {
+      long capacity = entry_capacity ? entry_capacity * 2 : HISTORY_INDEX_MIN;
+      history_entry *grown = realloc(entries, capacity * sizeof(*entries));
+      if (!grown) {
+        perror("history");
+        return;
+      }
+      entries = grown;
+      entry_capacity = capacity;
+    }
+    entries[entry_count].offset = indexed;
+    entries[entry_count].signature = signature(line, end - line);
+    entry_count++;
+    indexed = end + 1 - log_map;
+  }
+}
+
+/* Opens the log and gives its most recent entries to readline. Returns -1
+   if there is no persistent history.  */
+int history_log_open(const char *path) {
+  char *start, *end;
+  int count = 0;
+
+  log_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (log_fd < 0)
+    return -1;
+  if (log_refresh() < 0 || !log_mapped)
+    return 0;
+
+  /* Walk back HISTORY_LOAD lines from the end, then load them in order.  */
+  end = log_map + log_mapped;
+  while (end > log_map && end[-1] != '\n')
+    end--; /* partial line of a concurrent writer */
+  start = end;
+  while (start > log_map && count <= HISTORY_LOAD) {
+    start--;
+    while (start > log_map && start[-1] != '\n')
+      start--;
+    count++;
+  }
+  if (count > HISTORY_LOAD)
+    start = memchr(start, '\n', end - start) + 1;
+
+  while (start < end) {
+    char *line = memchr(start, '\n', end - start);
+    char *copy = strndup(start, line - start);
+    if (copy) {
+      add_history(copy);
+      free(copy);
+    }
+    start = line + 1;
+  }
+  return 0;
+}
+
+/* Appends a command line to the log, in one write.  */
+void history_log_append(const char *line) {
+  size_t length = strlen(line);
+  char *record;
+
+  if (log_fd < 0 || !length)
+    return;
+  record = malloc(length + 1);
+  if (!record)
+    return;
+  memcpy(record, line, length);
+  record[length] = '\n';
+  if (write(log_fd, record, length + 1) < 0)
+    perror("history");
+  free(record);
+}
+
+/* Number of entries, including those written by other shells.  */
+long history_log_count() {
+  index_update();
+  return entry_count;
+}
+
+/* Entry i, oldest first, not NUL-terminated.  */
+const char *history_log_entry(long i, size_t *length) {
+  const char *line = log_map + entries[i].offset;
+  const char *end = i + 1 < entry_count ? log_map + entries[i + 1].offset - 1
+                                        : log_map + indexed - 1;
+
+  *length = end - line;
+  return line;
+}
+
+/* Most recent entry before `before` that contains the query, or that starts
+   with it if `prefix` is set. Returns -1 if there is none.  */
+long history_log_search(const char *query, size_t length, long before,
+                        int prefix) {
+  uint64_t bits = signature(query, length);
+  const char *line;
+  size_t size;
+  long i;
+
+  for (i = before - 1; i >= 0; i--) {
+    if ((entries[i].signature & bits) != bits)
+      continue;
+    line = history_log_entry(i, &size);
+    if (size < length)
+      continue;
+    if (prefix ? memcmp(line, query, length) == 0
+               : memmem(line, size, query, length) != NULL)
+      return i;
+  }
+  return -1;
+}
+
+/* Shows entry i in the line buffer.  */
+static void show_entry(long i) {
+  size_t length;
+  const char *line = history_log_entry(i, &length);
+  char *copy = strndup(line, length);
+
+  if (copy) {
+    rl_replace_line(copy, 0);
+    free(copy);
+  }
+}
+
+/* Ctrl-R: incremental search of a substring, from the most recent entry.
+   Ctrl-R again goes to an older match, Ctrl-G gives up, any other key keeps
+   the match and is then handled by readline as usual, ESC just keeps it.  */
+static int search_key(int count, int key) {
+  char query[HISTORY_QUERY_MAX + 1];
+  char *saved = strdup(rl_line_buffer);
+  int saved_point = rl_point;
+  size_t length = 0;
+  long match = -1, total, found;
+  char *at;
+  int c;
+
+  (void)count;
+  (void)key;
+  total = history_log_count();
+  query[0] = '\0';
+  for (;;) {
+    rl_message("(reverse-i-search)`%s': ", query);
+    /* A failed search keeps the last match, which may not contain the
+       longer query: the cursor then goes to the end.  */
+    at = match >= 0 && length ? strstr(rl_line_buffer, query) : NULL;
+    rl_point = at ? at - rl_line_buffer : rl_end;
+    rl_redisplay();
+
+    c = rl_read_key();
+    if (c == CTRL('R')) {
+      if (!length)
+        continue;
+      found = history_log_search(query, length, match >= 0 ? match : total, 0);
+    } else if (c == CTRL('G')) {
+      rl_replace_line(saved ? saved : "", 0);
+      rl_point = saved_point;
+      break;
+    } else if (c == RUBOUT || c == CTRL('H')) {
+      if (length)
+        query[--length] = '\0';
+      found = length ? history_log_search(query, length, total, 0) : -1;
+      if (found < 0) {
+        match = -1;
+        rl_replace_line(saved ? saved : "", 0);
+        continue;
+      }
+    } else if (c == ESC) {
+      break;
+    } else if (c >= ' ' && length < HISTORY_QUERY_MAX) {
+      query[length++] = c;
+      query[length] = '\0';
+      /* The current match is kept while it still matches.  */
+      found = history_log_search(query, length,
+                                 match >= 0 ? match + 1 : total, 0);
+    } else {
+      /* Keep the match and let readline handle the key.  */
+      rl_execute_next(c);
+      break;
+    }
+
+    if (found < 0)
+      rl_ding();
+    else {
+      match = found;
+      show_entry(match);
+    }
+  }
+
+  free(saved);
+  rl_clear_message();
+  rl_redisplay();
+  return 0;
+}
+
+/* M-p: older entry starting with the text before the cursor. Pressed again,
+   goes on from the last match.  */
+static int prefix_key(int count, int key) {
+  static char *prefix;
+  static size_t length;
+  static long cursor;
+  long found;
+
+  (void)count;
+  (void)key;
+  if (rl_last_func != prefix_key) {
+    free(prefix);
+    prefix = strndup(rl_line_buffer, rl_point);
+    length = prefix ? rl_point : 0;
+    cursor = history_log_count();
+  }
+  found = history_log_search(prefix ? prefix : "", length, cursor, 1);
+  if (found < 0) {
+    rl_ding();
+    return 0;
+  }
+  cursor = found;
+  show_entry(found);
+  rl_point = length;
+  return 0;
+}
+
+void history_log_bind_keys() {
+  if (log_fd < 0)
+    return;
+  rl_bind_key(CTRL('R'), search_key);
+  rl_bind_keyseq("\\ep", prefix_key);
+}
+
+/* history [-s text | -p prefix] [N]: the last N entries (all by default),
+   or only those containing text or starting with prefix, oldest first.  */
+int history_command(int argc, char **argv) {
+  const char *query = NULL, *line;
+  long total, i, first, shown = 0, limit = -1, *found = NULL;
+  int prefix = 0, arg = 1;
+  size_t length = 0, size;
+  char *end;
+
+  if (log_fd < 0) {
+    fprintf(stderr, "history: no history file\n");
+    return 1;
+  }
+  if (arg + 1 < argc &&
+      (strcmp(argv[arg], "-s") == 0 || strcmp(argv[arg], "-p") == 0)) {
+    prefix = argv[arg][1] == 'p';
+    query = argv[arg + 1];
+    length = strlen(query);
+    arg += 2;
+  }
+  if (arg < argc) {
+    limit = strtol(argv[arg], &end, 10);
+    if (*end || limit < 0) {
+      fprintf(stderr, "history: %s: invalid number\n", argv[arg]);
+      return 2;
+    }
+  }
+
+  total = history_log_count();
+  if (!query) {
+    first = limit >= 0 && limit < total ? total - limit : 0;
+    for (i = first; i < total; i++) {
+      line = history_log_entry(i, &size);
+      printf("%6ld  %.*s\n", i + 1, (int)size, line);
+    }
+    return 0;
+  }
+
+  /* Search from the end, print in order.  */
+  if (limit < 0)
+    limit = total;
+  found = malloc((limit ? limit : 1) * sizeof(long));
+  if (!found) {
+    perror("history");
+    return 1;
+  }
+  for (i = total; shown < limit &&
+                  (i = history_log_search(query, length, i, prefix)) >= 0;)
+    found[shown++] = i;
+  while (shown--) {
+    line = history_log_entry(found[shown], &size);
+    printf("%6ld  %.*s\n", found[shown] + 1, (int)size, line);
+  }
+  free(found);
+  return 0;
+}
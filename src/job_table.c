@@ -0,0 +1,214 @@
+#include "job_table.h"
+#include "scheduler.h"
+
+/*
+ * Indexed job table.
+ *
+ * Jobs keep their number for their whole life: job N lives in slot N - 1 of a
+ * dense array, and a new job takes the number after the highest one in use,
+ * like in bash. Every process of every job is indexed by pid in a chained
+ * hash table, so reaping a child does not scan the job list. The list headed
+ * by `first_job` is doubly linked and only used to iterate over the jobs,
+ * most recent first. Jobs that completed or stopped are queued for
+ * do_job_notification, which never walks the whole list.
+ */
+
+static job **job_slots;      /* job_slots[id - 1], NULL for a free number */
+static int job_slots_size;   /* highest job number in use */
+static int job_slots_capacity;
+
+static process **pid_buckets;
+static size_t pid_bucket_count;
+static size_t pid_count;
+
+static job *notify_head; /* jobs whose state changed, oldest first */
+static job *notify_tail;
+
+static size_t pid_hash(pid_t pid) {
+  /* Fibonacci hashing spreads consecutive pids over the buckets.  */
+  return ((size_t)pid * 11400714819323198485ull) & (pid_bucket_count - 1);
+}
+
+static void pid_table_grow() {
+  size_t count = pid_bucket_count ? pid_bucket_count * 2 : PID_BUCKETS_MIN;
+  process **buckets = calloc(count, sizeof(process *));
+  size_t i;
+
+  if (!buckets) {
+    /* Keep the current table: longer chains, but still correct.  */
+    if (pid_bucket_count)
+      return;
+    perror("calloc");
+    exit(1);
+  }
+
+  process **old = pid_buckets;
+  size_t old_count = pid_bucket_count;
+  pid_buckets = buckets;
+  pid_bucket_count = count;
+
+  for (i = 0; i < old_count; i++) {
+    process *p = old[i], *next;
+    for (; p; p = next) {
+      next = p->hash_next;
+      size_t bucket = pid_hash(p->pid);
+      p->hash_next = pid_buckets[bucket];
+      pid_buckets[bucket] = p;
+    }
+  }
+  free(old);
+}
+
+static void pid_table_insert(process *p) {
+  if (pid_count >= pid_bucket_count)
+    pid_table_grow();
+
+  size_t bucket = pid_hash(p->pid);
+  p->hash_next = pid_buckets[bucket];
+  pid_buckets[bucket] = p;
+  pid_count++;
+}
+
+static void pid_table_remove(process *p) {
+  process **link;
+
+  if (!pid_bucket_count)
+    return;
+  for (link = &pid_buckets[pid_hash(p->pid)]; *link;
+       link = &(*link)->hash_next)
+    if (*link == p) {
+      *link = p->hash_next;
+      pid_count--;
+      return;
+    }
+}
+
+process *process_table_find(pid_t pid) {
+  process *p;
+
+  if (!pid_bucket_count)
+    return NULL;
+  for (p = pid_buckets[pid_hash(pid)]; p; p = p->hash_next)
+    if (p->pid == pid)
+      return p;
+  return NULL;
+}
+
+/* Indexes the processes of a job that has just been started.  */
+void job_table_started(job *j) {
+  process *p;
+
+  j->remaining = 0;
+  for (p = j->first_process; p; p = p->next) {
+    p->job = j;
+    if (p->completed)
+      continue;
+    j->remaining++;
+    if (p->pid > 0)
+      pid_table_insert(p);
+  }
+  /* Nothing could be started: report it like any completed job, and give
+     its slot back since no child will be reaped for it.  */
+  if (!j->remaining) {
+    clock_gettime(CLOCK_MONOTONIC, &j->finished);
+    scheduler_release(j);
+    job_table_notify(j);
+  }
+}
+
+/* Registers a job: number, pid index and head of the job list. A job that
+   is not started yet is indexed by job_table_started later.  */
+void job_table_add(job *j) {
+  if (job_slots_size == job_slots_capacity) {
+    int capacity =
+        job_slots_capacity ? job_slots_capacity * 2 : JOB_TABLE_MIN;
+    job **slots = realloc(job_slots, capacity * sizeof(job *));
+    if (!slots) {
+      perror("realloc");
+      exit(1);
+    }
+    job_slots = slots;
+    job_slots_capacity = capacity;
+  }
+  j->id = ++job_slots_size;
+  job_slots[j->id - 1] = j;
+
+  j->queued = 0;
+  j->notify_next = NULL;
+  j->prev = NULL;
+  j->next = first_job;
+  if (first_job)
+    first_job->prev = j;
+  first_job = j;
+
+  if (!j->deferred)
+    job_table_started(j);
+}
+
+/* Forgets a job in constant time (per process).  */
+void job_table_remove(job *j) {
+  process *p;
+
+  for (p = j->first_process; p; p = p->next)
+    if (p->pid > 0)
+      pid_table_remove(p);
+
+  if (j->prev)
+    j->prev->next = j->next;
+  else
+    first_job = j->next;
+  if (j->next)
+    j->next->prev = j->prev;
+
+  job_slots[j->id - 1] = NULL;
+  while (job_slots_size > 0 && !job_slots[job_slots_size - 1])
+    job_slots_size--;
+
+  /* Unlink it from the notification queue if it is still there.  */
+  if (j->queued) {
+    job **link = &notify_head;
+    job *last = NULL;
+    while (*link != j) {
+      last = *link;
+      link = &(*link)->notify_next;
+    }
+    *link = j->notify_next;
+    if (notify_tail == j)
+      notify_tail = last;
+    j->queued = 0;
+  }
+}
+
+job *job_table_find(int id) {
+  if (id <= 0 || id > job_slots_size)
+    return NULL;
+  return job_slots[id - 1];
+}
+
+/* Queues a job whose state changed for the next do_job_notification.  */
+void job_table_notify(job *j) {
+  if (j->queued)
+    return;
+  j->queued = 1;
+  j->notify_next = NULL;
+  if (notify_tail)
+    notify_tail->notify_next = j;
+  else
+    notify_head = j;
+  notify_tail = j;
+}
+
+job *job_table_next_notification() {
+  job *j = notify_head;
+
+  if (j) {
+    notify_head = j->notify_next;
+    if (!notify_head)
+      notify_tail = NULL;
+    j->notify_next = NULL;
+    j->queued = 0;
+  }
+  return j;
+}
+
+int job_table_has_notifications() { return notify_head != NULL; }
@@ -0,0 +1,87 @@
+#include "job_time.h"
+
+#include <time.h>
+
+/*
+ * Resource accounting of the jobs.
+ *
+ * The rusage of each process comes from wait4 when it is reaped. While a
+ * process still runs, its CPU time is read from /proc/<pid>/stat instead.
+ */
+
+static double timeval_seconds(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* CPU time of a running process, -1 if /proc cannot tell.  */
+static double proc_cpu_seconds(pid_t pid) {
+  char path[64], buffer[512], *fields;
+  unsigned long long utime, stime;
+  ssize_t n;
+  int fd;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  n = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buffer[n] = '\0';
+
+  /* The command name may contain spaces: the fields follow its last ')'.
+     utime and stime are fields 14 and 15, state being field 3.  */
+  fields = strrchr(buffer, ')');
+  if (!fields || sscanf(fields + 2,
+                        "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                        "%llu %llu",
+                        &utime, &stime) != 2)
+    return -1;
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* CPU time used by a process so far.  */
+double process_cpu_seconds(process *p) {
+  double seconds;
+
+  if (!p->completed && p->pid > 0 &&
+      (seconds = proc_cpu_seconds(p->pid)) >= 0)
+    return seconds;
+  return timeval_seconds(p->usage.ru_utime) +
+         timeval_seconds(p->usage.ru_stime);
+}
+
+double job_cpu_seconds(job *j) {
+  double seconds = 0;
+  process *p;
+
+  for (p = j->first_process; p; p = p->next)
+    seconds += process_cpu_seconds(p);
+  return seconds;
+}
+
+/* Prints what `time` reports: wall clock time of the job, then user time,
+   system time and peak memory of each stage.  */
+void job_print_times(job *j) {
+  struct timeval user = {0, 0}, sys = {0, 0};
+  double real;
+  process *p;
+  int stage = 1;
+
+  real = (j->finished.tv_sec - j->started.tv_sec) +
+         (j->finished.tv_nsec - j->started.tv_nsec) / 1e9;
+
+  fprintf(stderr, "%-6s %10s %10s %10s  %s\n", "stage", "user", "sys",
+          "maxrss", "command");
+  for (p = j->first_process; p; p = p->next, stage++) {
+    fprintf(stderr, "%-6d %9.3fs %9.3fs %8ldKB  %s\n", stage,
+            timeval_seconds(p->usage.ru_utime),
+            timeval_seconds(p->usage.ru_stime), p->usage.ru_maxrss,
+            p->argv[0]);
+    timeradd(&user, &p->usage.ru_utime, &user);
+    timeradd(&sys, &p->usage.ru_stime, &sys);
+  }
+  fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs\n", real,
+          timeval_seconds(user), timeval_seconds(sys));
+}
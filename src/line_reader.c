@@ -0,0 +1,105 @@
+#include "line_reader.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Line reader for the batch mode.
+ *
+ * Readline is made for a terminal: it reads one byte per system call and
+ * keeps a history. Scripts and pipes are read by blocks instead, and each
+ * line is handed out in place, NUL-terminated, without being copied. Like
+ * dash, the shell may read ahead of the command being run, so commands do
+ * not share the shell's own input.
+ */
+
+int line_reader_open(line_reader *r, int fd) {
+  r->fd = fd;
+  r->size = LINE_READER_SIZE;
+  r->start = r->end = 0;
+  r->owned = 1;
+  r->buffer = malloc(r->size + 1);
+  if (!r->buffer) {
+    perror("malloc");
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads the lines of `string`, which is cut in place (-c).  */
+void line_reader_string(line_reader *r, char *string) {
+  r->fd = -1;
+  r->buffer = string;
+  r->start = 0;
+  r->end = r->size = strlen(string);
+  r->owned = 0;
+}
+
+/* Moves the partial line to the front and reads more data after it.
+   Returns 0 at end of input.  */
+static ssize_t fill(line_reader *r) {
+  ssize_t n;
+
+  if (r->start > 0) {
+    memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  if (r->end == r->size) {
+    /* A line longer than the buffer.  */
+    char *grown = realloc(r->buffer, r->size * 2 + 1);
+    if (!grown) {
+      perror("realloc");
+      return -1;
+    }
+    r->buffer = grown;
+    r->size *= 2;
+  }
+
+  do
+    n = read(r->fd, r->buffer + r->end, r->size - r->end);
+  while (n < 0 && errno == EINTR);
+  if (n < 0)
+    perror("read");
+  else
+    r->end += n;
+  return n;
+}
+
+/* Returns the next line without its newline, or NULL at end of input. The
+   line stays valid until the next call.  */
+char *line_reader_next(line_reader *r) {
+  size_t scanned = r->start;
+  char *newline, *line;
+
+  for (;;) {
+    newline = memchr(r->buffer + scanned, '\n', r->end - scanned);
+    if (newline)
+      break;
+    scanned = r->end - r->start;
+    if (r->fd < 0 || fill(r) <= 0) {
+      /* Last line without a newline.  */
+      if (r->start == r->end)
+        return NULL;
+      newline = r->buffer + r->end;
+      break;
+    }
+    scanned += r->start;
+  }
+
+  line = r->buffer + r->start;
+  r->start = newline - r->buffer + (newline < r->buffer + r->end);
+  *newline = '\0';
+  return line;
+}
+
+void line_reader_close(line_reader *r) {
+  if (r->owned)
+    free(r->buffer);
+  if (r->fd > STDERR_FILENO)
+    close(r->fd);
+  r->buffer = NULL;
+}
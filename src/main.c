@@ -1,11 +1,100 @@
+#include "builtins.h"
+#include "completion.h"
+#include "history_log.h"
+#include "line_reader.h"
 #include "parse.h"
+#include "scheduler.h"
 #include "terminal.h"
-int main() {
+
+/* Parses and runs one command line.  */
+static void run_line(char *input) {
+  job *j = parse_command(input);
+
+  if (j && j->first_process) {
+    /* Builtins run in the shell, anything else is launched */
+    if (!builtin_run_job(j))
+      launch_job(j, !j->background);
+  } else if (j) {
+    free_job(j);
+  }
+}
+
+/* Runs the commands of a script, a pipe or a -c string: no prompt, no
+   history, and the status of the last command is returned.  */
+static int run_batch(line_reader *reader) {
+  char *line;
+
+  while ((line = line_reader_next(reader))) {
+    /* Report background jobs that finished, like before a prompt */
+    check_jobs_status();
+    run_line(line);
+  }
+  line_reader_close(reader);
+
+  /* Queued jobs would never start once the shell is gone.  */
+  if (scheduler_pending()) {
+    char *wait_all[] = {"wait", NULL};
+    wait_command(1, wait_all);
+  }
+  return last_status;
+}
+
+/* Persistent history of the interactive shell: $MAEL_HISTFILE, or
+   HISTORY_FILE in the home directory.  */
+static void open_history() {
+  const char *path = getenv("MAEL_HISTFILE"), *home;
+  char buffer[PATH_MAX];
+
+  if (!path || !*path) {
+    home = getenv("HOME");
+    if (!home)
+      return;
+    snprintf(buffer, sizeof(buffer), "%s/%s", home, HISTORY_FILE);
+    path = buffer;
+  }
+  if (history_log_open(path) < 0)
+    fprintf(stderr, "history: %s: %s\n", path, strerror(errno));
+  history_log_bind_keys();
+}
+
+int main(int argc, char **argv) {
+  line_reader reader;
+
+  /* shell -c command, shell script, or commands piped on stdin */
+  if (argc > 1) {
+    if (strcmp(argv[1], "-c") == 0) {
+      if (argc < 3) {
+        fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+        return 2;
+      }
+      line_reader_string(&reader, argv[2]);
+    } else {
+      int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+        return 127;
+      }
+      if (line_reader_open(&reader, fd) < 0)
+        return 2;
+    }
+    shell_batch = 1;
+  } else if (!isatty(STDIN_FILENO)) {
+    if (line_reader_open(&reader, STDIN_FILENO) < 0)
+      return 2;
+    shell_batch = 1;
+  }
+
   init_shell();
 
   /* Enable job control signals */
   signal(SIGCHLD, SIG_DFL);
 
+  if (shell_batch)
+    return run_batch(&reader);
+
+  open_history();
+  completion_init();
+
   while (true) {
     /* Check for and report any terminated jobs */
     check_jobs_status();
@@ -22,58 +111,13 @@ int main() {
     /* Skip empty lines */
     if (input[0] != '\0') {
       add_history(input);
-
-      /* Check for built-in commands */
-      if (strcmp(input, "exit") == 0) {
-        free(input);
-        break;
-      } else if (strcmp(input, "jobs") == 0) {
-        list_jobs();
-        free(input);
-        continue;
-      } else if (strncmp(input, "fg", 2) == 0) {
-        char *arg = input + 2;
-        while (*arg && isspace(*arg))
-          arg++; // Skip whitespace
-        do_fg(arg);
-        free(input);
-        continue;
-      } else if (strncmp(input, "bg", 2) == 0) {
-        char *arg = input + 2;
-        while (*arg && isspace(*arg))
-          arg++; // Skip whitespace
-        do_bg(arg);
-        free(input);
-        continue;
-      } else if (strncmp(input, "cd", 2) == 0) {
-        char *dir = input + 2;
-        while (*dir && isspace(*dir))
-          dir++; /* Skip whitespace */
-
-        if (*dir == '\0')
-          dir = getenv("HOME");
-
-        if (chdir(dir) != 0)
-          perror("chdir");
-
-        free(input);
-        continue;
-      }
-
-      /* Parse the command */
-      job *j = parse_command(input);
-      if (j && j->first_process) {
-        /* Launch the job */
-        launch_job(j, !j->background);
-      } else if (j) {
-        free(j->command);
-        free(j);
-      }
+      history_log_append(input);
+      run_line(input);
     }
 
     free(input);
   }
 
   printf("Exiting mael shell...\n");
-  return 0;
+  return last_status;
 }
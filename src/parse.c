@@ -1,212 +1,399 @@
 #include "parse.h"
 
-/**
- * Parses a command line input into a `job` structure.
- * Handles background execution, piping, redirection of stdin/stdout/stderr,
- * and constructs a linked list of `process` structures.
+#include "arena.h"
+#include "glob_expand.h"
+
+/*
+ * Single-pass lexer.
+ *
+ * The job, its processes, their argv and the words all live in one arena
+ * owned by the job, so free_job releases a command with a single call. The
+ * line is copied once into the arena and split in place: removing quotes and
+ * backslashes only ever shrinks a word, so the write pointer never passes the
+ * read pointer. Operators do not need to be surrounded by blanks, and there
+ * is no limit on the number of words. A word starting with '#' begins a
+ * comment. Words with an unquoted *, ? or [ are expanded to the matching
+ * paths, or kept as they are when nothing matches.
  */
-job *parse_command(char *input) {
-  // Allocate memory for the job structure
-  job *j = malloc(sizeof(job));
-  if (!j) {
-    perror("malloc");
+
+typedef enum {
+  TOKEN_END,
+  TOKEN_WORD,
+  TOKEN_PIPE,       /* | */
+  TOKEN_BACKGROUND, /* & */
+  TOKEN_IN,         /* < */
+  TOKEN_OUT,        /* > */
+  TOKEN_APPEND,     /* >> */
+  TOKEN_ERR,        /* 2> */
+  TOKEN_ERR_APPEND, /* 2>> */
+  TOKEN_BOTH,       /* &> */
+  TOKEN_ERROR
+} token_type;
+
+typedef struct lexer {
+  char *read;  /* next character to look at */
+  char *write; /* where the current word is being written */
+  char held;   /* character overwritten by the end of the last word */
+  char glob;   /* the last word has an unquoted *, ? or [ */
+  char quoted; /* ... and also quoted ones, or backslashes */
+  char *raw;   /* the last word as typed, before quote removal */
+} lexer;
+
+static const char *token_names[] = {"newline", "word", "|",  "&", "<",
+                                    ">",       ">>",   "2>", "2>>", "&>"};
+
+static int is_blank(char c) { return c == ' ' || c == '\t' || c == '\n'; }
+
+static int is_operator(char c) {
+  return c == '|' || c == '&' || c == '<' || c == '>';
+}
+
+/* Characters that have to be escaped in a pattern to be taken literally.  */
+static int is_glob_char(char c) {
+  return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static char peek(lexer *lx) { return lx->held ? lx->held : *lx->read; }
+
+static void advance(lexer *lx) {
+  lx->held = 0;
+  lx->read++;
+}
+
+/* Reads a word into the buffer, removing quotes and backslashes.  */
+static int read_word(lexer *lx, char **word) {
+  char c;
+
+  *word = lx->write;
+  lx->raw = lx->read;
+  lx->glob = lx->quoted = 0;
+  while ((c = peek(lx)) && !is_blank(c) && !is_operator(c)) {
+    advance(lx);
+    if (c == '\'') {
+      while (*lx->read && *lx->read != '\'') {
+        lx->quoted |= is_glob_char(*lx->read);
+        *lx->write++ = *lx->read++;
+      }
+      if (!*lx->read)
+        return -1;
+      lx->read++;
+    } else if (c == '"') {
+      while (*lx->read && *lx->read != '"') {
+        if (*lx->read == '\\' && strchr("\"\\$`", lx->read[1]))
+          lx->read++;
+        lx->quoted |= is_glob_char(*lx->read);
+        *lx->write++ = *lx->read++;
+      }
+      if (!*lx->read)
+        return -1;
+      lx->read++;
+    } else if (c == '\\') {
+      if (*lx->read) {
+        lx->quoted |= is_glob_char(*lx->read);
+        *lx->write++ = *lx->read++;
+      }
+    } else {
+      lx->glob |= c == '*' || c == '?' || c == '[';
+      *lx->write++ = c;
+    }
+  }
+
+  /* Terminating the word may overwrite the operator that follows it.  */
+  if (lx->write == lx->read)
+    lx->held = *lx->read;
+  *lx->write++ = '\0';
+  return 0;
+}
+
+static token_type next_token(lexer *lx, char **word) {
+  char c;
+
+  while (is_blank(peek(lx)))
+    advance(lx);
+  lx->write = lx->read;
+
+  switch (c = peek(lx)) {
+  case '\0':
+  case '#': /* a comment runs to the end of the line */
+    return TOKEN_END;
+  case '|':
+    advance(lx);
+    return TOKEN_PIPE;
+  case '<':
+    advance(lx);
+    return TOKEN_IN;
+  case '>':
+    advance(lx);
+    if (peek(lx) == '>') {
+      advance(lx);
+      return TOKEN_APPEND;
+    }
+    return TOKEN_OUT;
+  case '&':
+    advance(lx);
+    if (peek(lx) == '>') {
+      advance(lx);
+      return TOKEN_BOTH;
+    }
+    return TOKEN_BACKGROUND;
+  case '2':
+    if (lx->read[1] == '>') {
+      advance(lx);
+      advance(lx);
+      if (peek(lx) == '>') {
+        advance(lx);
+        return TOKEN_ERR_APPEND;
+      }
+      return TOKEN_ERR;
+    }
+    break;
+  }
+
+  if (read_word(lx, word) < 0) {
+    fprintf(stderr, "syntax error: unterminated quote\n");
+    return TOKEN_ERROR;
+  }
+  return TOKEN_WORD;
+}
+
+/* Points a standard channel of the job to `fd`, closing the file it used
+   unless another channel still shares it.  */
+static void set_channel(job *j, int *channel, int fd, int std) {
+  int old = *channel;
+
+  *channel = fd;
+  if (old != std && old != j->stdin && old != j->stdout && old != j->stderr)
+    close(old);
+}
+
+/* Opens the target of a redirection. It is closed on exec, so only the
+   processes that dup2() it keep it open.  */
+static int redirect(job *j, token_type type, const char *path) {
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  int fd;
+
+  if (type == TOKEN_IN)
+    flags = O_RDONLY | O_CLOEXEC;
+  else if (type == TOKEN_APPEND || type == TOKEN_ERR_APPEND)
+    flags |= O_APPEND;
+  else
+    flags |= O_TRUNC;
+
+  fd = open(path, flags, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  switch (type) {
+  case TOKEN_IN:
+    set_channel(j, &j->stdin, fd, STDIN_FILENO);
+    break;
+  case TOKEN_OUT:
+  case TOKEN_APPEND:
+    set_channel(j, &j->stdout, fd, STDOUT_FILENO);
+    break;
+  case TOKEN_BOTH:
+    set_channel(j, &j->stdout, fd, STDOUT_FILENO);
+    set_channel(j, &j->stderr, fd, STDERR_FILENO);
+    break;
+  default:
+    set_channel(j, &j->stderr, fd, STDERR_FILENO);
+    break;
+  }
+  return 0;
+}
+
+/* Turns the raw text of the last word, which is still intact in `source`,
+   into a pattern where the quoted characters are escaped with '\'.  */
+static char *quoted_pattern(job *j, lexer *lx, const char *source,
+                            const char *base) {
+  const char *p = source + (lx->raw - base);
+  const char *end = source + (lx->read - base);
+  char *pattern = arena_alloc(j->arena, 2 * (end - p) + 1), *out = pattern;
+  char quote = 0;
+
+  if (!pattern)
     return NULL;
+  for (; p < end; p++) {
+    if (quote ? *p == quote : *p == '\'' || *p == '"') {
+      quote = quote ? 0 : *p;
+      continue;
+    }
+    if (*p == '\\' && quote != '\'' &&
+        (!quote || strchr("\"\\$`", p[1])))
+      p++;
+    else if (!quote) {
+      *out++ = *p;
+      continue;
+    }
+    if (is_glob_char(*p))
+      *out++ = '\\';
+    *out++ = *p;
+  }
+  *out = '\0';
+  return pattern;
+}
+
+/* Word buffer of the lexer, kept between commands so that it only grows.  */
+static char **words;
+static int words_capacity;
+
+static int add_word(int count, char *word) {
+  if (count + 1 >= words_capacity) {
+    int capacity = words_capacity ? words_capacity * 2 : ARGS_MIN;
+    char **grown = realloc(words, capacity * sizeof(char *));
+    if (!grown)
+      return -1;
+    words = grown;
+    words_capacity = capacity;
   }
+  words[count] = word;
+  return 0;
+}
 
-  // Initialize the job structure with default values
-  j->command = strdup(input);
+/* Allocates an empty job, with room in its arena for `size_hint` more bytes
+   than the job and its command line.  */
+job *job_create(const char *command, size_t size_hint) {
+  size_t len = strlen(command);
+  arena *a = arena_create(sizeof(job) + len + 1 + size_hint);
+  job *j;
+
+  if (!a)
+    return NULL;
+  j = arena_calloc(a, sizeof(job));
+  j->arena = a;
   j->stdin = STDIN_FILENO;
   j->stdout = STDOUT_FILENO;
   j->stderr = STDERR_FILENO;
-  j->pgid = 0;
-  j->notified = 0;
-  j->next = NULL;
-  j->background = 0;
-
-  // Make a modifiable copy of the input for parsing
-  char *input_copy = strdup(input);
-  if (!input_copy) {
-    perror("strdup");
-    free(j->command);
-    free(j);
+  j->command = arena_strndup(a, command, len);
+  if (!j->command) {
+    arena_destroy(a);
     return NULL;
   }
+  return j;
+}
 
-  // Check if the command ends with '&' to run it in the background
-  int len = strlen(input_copy);
-  if (len > 0 && input_copy[len - 1] == '&') {
-    input_copy[len - 1] = '\0';
-    j->background = 1;
-    // Trim trailing whitespace
-    len = strlen(input_copy);
-    while (len > 0 && isspace(input_copy[len - 1])) {
-      input_copy[len - 1] = '\0';
-      len--;
-    }
-  }
+/* Appends a process running `argv[0..count)` to the job. The strings must
+   live as long as the job.  */
+process *job_add_process(job *j, char **argv, int count) {
+  process *p, **link;
+
+  p = arena_calloc(j->arena, sizeof(process));
+  if (!p)
+    return NULL;
+  p->argv = arena_alloc(j->arena, (count + 1) * sizeof(char *));
+  if (!p->argv)
+    return NULL;
+  memcpy(p->argv, argv, count * sizeof(char *));
+  p->argv[count] = NULL;
+  p->taille = count;
 
-  // Initialize the process list
-  process *head = NULL;
-  process *tail = NULL;
+  for (link = &j->first_process; *link; link = &(*link)->next)
+    ;
+  *link = p;
+  return p;
+}
 
-  // Tokenize input based on the pipe symbol '|'
-  char *saveptr;
-  char *pipe_token = strtok_r(input_copy, "|", &saveptr);
+/**
+ * Parses a command line input into a `job` structure.
+ * Handles background execution, piping, redirection of stdin/stdout/stderr,
+ * and constructs a linked list of `process` structures.
+ */
+job *parse_command(char *input) {
+  size_t len = strlen(input);
+  int count = 0;
+  token_type type;
+  char *word, *base;
+  lexer lx;
 
-  while (pipe_token) {
-    // Trim leading whitespace
-    while (*pipe_token && isspace(*pipe_token)) {
-      pipe_token++;
-    }
+  /* Room for the words and the argv of a short pipeline.  */
+  job *j = job_create(input, len + 1 + sizeof(process) +
+                                 ARGS_MIN * sizeof(char *));
+  if (!j) {
+    perror("malloc");
+    return NULL;
+  }
 
-    // Skip empty segments
-    if (*pipe_token) {
-      // Allocate and initialize a new process
-      process *p = malloc(sizeof(process));
-      if (!p) {
-        perror("malloc");
-        // Cleanup on failure
-        free(input_copy);
-        while (head) {
-          process *next = head->next;
-          free(head);
-          head = next;
-        }
-        free(j->command);
-        free(j);
-        return NULL;
-      }
+  lx.read = base = arena_strndup(j->arena, input, len);
+  lx.held = 0;
+  if (!lx.read)
+    goto nomem;
 
-      p->next = NULL;
-      p->completed = 0;
-      p->stopped = 0;
-      p->status = 0;
-      p->pid = 0;
-
-      // Parse arguments and redirection symbols
-      char *token_copy = strdup(pipe_token);
-      char **args = malloc(64 * sizeof(char *));
-      if (!args || !token_copy) {
-        perror("malloc/strdup");
-        // Cleanup on failure
-        free(token_copy);
-        free(p);
-        free(input_copy);
-        while (head) {
-          process *next = head->next;
-          free(head);
-          head = next;
-        }
-        free(j->command);
-        free(j);
-        return NULL;
+  while ((type = next_token(&lx, &word)) != TOKEN_END) {
+    switch (type) {
+    case TOKEN_WORD:
+      /* `time` before a pipeline is a keyword, like in bash.  */
+      if (!count && !j->first_process && !j->timed &&
+          strcmp(word, "time") == 0) {
+        j->timed = 1;
+        break;
       }
+      if (lx.glob) {
+        char *pattern = lx.quoted ? quoted_pattern(j, &lx, input, base) : word;
+        char **matches;
+        size_t found, k;
 
-      int arg_index = 0;
-      char *arg_saveptr;
-      char *arg = strtok_r(token_copy, " \t", &arg_saveptr);
-
-      // Flags to track redirection types
-      bool next_token_is_input = false;
-      bool next_token_is_output = false;
-      bool next_token_is_output_append = false;
-      bool next_token_is_stderr = false;
-      bool next_token_is_stderr_append = false;
-      bool next_token_is_both = false;
-
-      // Parse arguments and handle I/O redirections
-      while (arg && arg_index < 63) {
-        if (strcmp(arg, "<") == 0) {
-          next_token_is_input = true;
-        } else if (strcmp(arg, ">") == 0) {
-          next_token_is_output = true;
-        } else if (strcmp(arg, ">>") == 0) {
-          next_token_is_output_append = true;
-        } else if (strcmp(arg, "2>") == 0) {
-          next_token_is_stderr = true;
-        } else if (strcmp(arg, "2>>") == 0) {
-          next_token_is_stderr_append = true;
-        } else if (strcmp(arg, "&>") == 0) {
-          next_token_is_both = true;
-        } else if (next_token_is_input) {
-          int fd = open(arg, O_RDONLY);
-          if (fd < 0) {
-            perror("open <");
-          } else {
-            j->stdin = fd;
-          }
-          next_token_is_input = false;
-        } else if (next_token_is_output) {
-          int fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-          if (fd < 0) {
-            perror("open >");
-          } else {
-            j->stdout = fd;
-          }
-          next_token_is_output = false;
-        } else if (next_token_is_output_append) {
-          int fd = open(arg, O_WRONLY | O_CREAT | O_APPEND, 0644);
-          if (fd < 0) {
-            perror("open >>");
-          } else {
-            j->stdout = fd;
-          }
-          next_token_is_output_append = false;
-        } else if (next_token_is_stderr) {
-          int fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-          if (fd < 0) {
-            perror("open 2>");
-          } else {
-            j->stderr = fd;
-          }
-          next_token_is_stderr = false;
-        } else if (next_token_is_stderr_append) {
-          int fd = open(arg, O_WRONLY | O_CREAT | O_APPEND, 0644);
-          if (fd < 0) {
-            perror("open 2>>");
-          } else {
-            j->stderr = fd;
-          }
-          next_token_is_stderr_append = false;
-        } else if (next_token_is_both) {
-          int fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-          if (fd < 0) {
-            perror("open &>");
-          } else {
-            j->stdout = fd;
-            j->stderr = fd;
-          }
-          next_token_is_both = false;
-        } else {
-          // Regular argument
-          args[arg_index++] = strdup(arg);
-        }
-
-        arg = strtok_r(NULL, " \t", &arg_saveptr);
+        if (!pattern)
+          goto nomem;
+        matches = glob_expand(j->arena, pattern, &found);
+        for (k = 0; k < found; k++, count++)
+          if (add_word(count, matches[k]) < 0)
+            goto nomem;
+        if (found)
+          break;
       }
-
-      args[arg_index] = NULL;
-      p->argv = args;
-      p->taille = arg_index;
-
-      free(token_copy);
-
-      // Add the process to the job's process list
-      if (!head) {
-        head = tail = p;
-      } else {
-        tail->next = p;
-        tail = p;
+      if (add_word(count, word) < 0)
+        goto nomem;
+      count++;
+      break;
+    case TOKEN_PIPE:
+      /* Empty pipeline segments are skipped.  */
+      if (count && !job_add_process(j, words, count))
+        goto nomem;
+      count = 0;
+      break;
+    case TOKEN_BACKGROUND:
+      /* Only a trailing '&' is supported.  */
+      type = next_token(&lx, &word);
+      if (type != TOKEN_END) {
+        if (type != TOKEN_ERROR)
+          fprintf(stderr, "syntax error near `&'\n");
+        goto fail;
       }
+      j->background = 1;
+      goto done;
+    case TOKEN_IN:
+    case TOKEN_OUT:
+    case TOKEN_APPEND:
+    case TOKEN_ERR:
+    case TOKEN_ERR_APPEND:
+    case TOKEN_BOTH: {
+      token_type target = next_token(&lx, &word);
+      if (target != TOKEN_WORD) {
+        if (target != TOKEN_ERROR)
+          fprintf(stderr, "syntax error near `%s'\n", token_names[target]);
+        goto fail;
+      }
+      if (redirect(j, type, word) < 0)
+        goto fail;
+      break;
+    }
+    default:
+      goto fail;
     }
-
-    // Continue with the next segment of the pipeline
-    pipe_token = strtok_r(NULL, "|", &saveptr);
   }
 
-  // Finalize the job structure
-  free(input_copy);
-  j->first_process = head;
-
+done:
+  glob_cache_clear();
+  if (count && !job_add_process(j, words, count))
+    goto nomem;
   return j;
+
+nomem:
+  perror("malloc");
+fail:
+  glob_cache_clear();
+  free_job(j);
+  return NULL;
 }
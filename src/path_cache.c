@@ -0,0 +1,268 @@
+#include "path_cache.h"
+
+/*
+ * Cache of the PATH search.
+ *
+ * execvp tries every PATH directory in every child, and each miss is a failed
+ * execve. The shell resolves command names once instead and keeps the result,
+ * the children exec the full path with execv. Names that were not found are
+ * cached too, as long as no PATH directory changes. The whole table is
+ * dropped when PATH changes or on `hash -r`.
+ */
+
+typedef struct path_entry {
+  struct path_entry *next; /* next entry in the same bucket */
+  char *path;              /* full path, NULL if the command was not found */
+  unsigned hits;           /* times the entry was used, for `hash` */
+  char name[];
+} path_entry;
+
+typedef struct path_dir {
+  char *dir;             /* directory of PATH, "." for an empty element */
+  struct timespec mtime; /* last change seen, to expire the misses */
+} path_dir;
+
+static path_entry **buckets;
+static size_t bucket_count;
+static size_t entry_count;
+
+static char *cached_path; /* value of PATH the table was built for */
+static path_dir *dirs;
+static int dir_count;
+
+static size_t name_hash(const char *name) {
+  size_t hash = 14695981039346656037ull; /* FNV-1a */
+
+  while (*name)
+    hash = (hash ^ (unsigned char)*name++) * 1099511628211ull;
+  return hash & (bucket_count - 1);
+}
+
+void path_clear() {
+  size_t i;
+
+  for (i = 0; i < bucket_count; i++) {
+    path_entry *e = buckets[i], *next;
+    for (; e; e = next) {
+      next = e->next;
+      free(e->path);
+      free(e);
+    }
+    buckets[i] = NULL;
+  }
+  entry_count = 0;
+}
+
+/* Splits PATH into its directories and forgets everything learnt from the
+   previous value.  */
+static void load_path(const char *path) {
+  const char *start, *end;
+  int i;
+
+  path_clear();
+  for (i = 0; i < dir_count; i++)
+    free(dirs[i].dir);
+  free(dirs);
+  free(cached_path);
+  dirs = NULL;
+  dir_count = 0;
+  cached_path = strdup(path);
+
+  for (i = 1, start = path; *start; start++)
+    i += *start == ':';
+  dirs = calloc(i, sizeof(path_dir));
+  if (!dirs || !cached_path)
+    return;
+
+  for (start = path;; start = end + 1) {
+    end = strchrnul(start, ':');
+    dirs[dir_count].dir =
+        end == start ? strdup(".") : strndup(start, end - start);
+    if (dirs[dir_count].dir)
+      dir_count++;
+    if (!*end)
+      break;
+  }
+}
+
+/* Tells whether a PATH directory changed since the misses were cached.  */
+static int dirs_changed() {
+  struct stat st;
+  int i, changed = 0;
+
+  for (i = 0; i < dir_count; i++) {
+    if (stat(dirs[i].dir, &st) < 0)
+      st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+    if (st.st_mtim.tv_sec != dirs[i].mtime.tv_sec ||
+        st.st_mtim.tv_nsec != dirs[i].mtime.tv_nsec) {
+      dirs[i].mtime = st.st_mtim;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+/* Drops the cached misses, a directory may have gained the command.  */
+static void forget_misses() {
+  size_t i;
+
+  for (i = 0; i < bucket_count; i++) {
+    path_entry **link = &buckets[i];
+    while (*link) {
+      path_entry *e = *link;
+      if (!e->path) {
+        *link = e->next;
+        free(e);
+        entry_count--;
+      } else
+        link = &e->next;
+    }
+  }
+}
+
+/* Searches PATH the way execvp does.  */
+static char *search_path(const char *name) {
+  size_t len = strlen(name);
+  struct stat st;
+  char *full;
+  int i;
+
+  for (i = 0; i < dir_count; i++) {
+    size_t dir_len = strlen(dirs[i].dir);
+    full = malloc(dir_len + len + 2);
+    if (!full)
+      return NULL;
+    memcpy(full, dirs[i].dir, dir_len);
+    full[dir_len] = '/';
+    memcpy(full + dir_len + 1, name, len + 1);
+    if (stat(full, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(full, X_OK) == 0)
+      return full;
+    free(full);
+  }
+  return NULL;
+}
+
+static void table_grow() {
+  size_t count = bucket_count ? bucket_count * 2 : PATH_BUCKETS_MIN;
+  path_entry **grown = calloc(count, sizeof(path_entry *));
+  path_entry **old = buckets;
+  size_t i, old_count = bucket_count;
+
+  if (!grown)
+    return;
+  buckets = grown;
+  bucket_count = count;
+  for (i = 0; i < old_count; i++) {
+    path_entry *e = old[i], *next;
+    for (; e; e = next) {
+      size_t bucket = name_hash(e->name);
+      next = e->next;
+      e->next = buckets[bucket];
+      buckets[bucket] = e;
+    }
+  }
+  free(old);
+}
+
+/* Returns the full path to execute for `name`, or NULL if it is not in
+   PATH. The string belongs to the cache: copy it to keep it.  */
+const char *path_lookup(const char *name) {
+  const char *path = getenv("PATH");
+  path_entry *e;
+  size_t bucket;
+
+  /* Paths are used as they are, like execvp does.  */
+  if (strchr(name, '/'))
+    return name;
+
+  if (!path)
+    path = "/bin:/usr/bin";
+  if (!cached_path || strcmp(path, cached_path) != 0) {
+    load_path(path);
+    dirs_changed();
+  }
+  if (!bucket_count)
+    table_grow();
+  if (!bucket_count)
+    return NULL;
+
+  for (e = buckets[name_hash(name)]; e; e = e->next)
+    if (strcmp(e->name, name) == 0) {
+      if (e->path) {
+        e->hits++;
+        return e->path;
+      }
+      if (!dirs_changed())
+        return NULL;
+      forget_misses();
+      break;
+    }
+
+  if (entry_count >= bucket_count)
+    table_grow();
+  e = malloc(sizeof(path_entry) + strlen(name) + 1);
+  if (!e)
+    return NULL;
+  strcpy(e->name, name);
+  e->path = search_path(name);
+  e->hits = e->path ? 1 : 0;
+  bucket = name_hash(name);
+  e->next = buckets[bucket];
+  buckets[bucket] = e;
+  entry_count++;
+  return e->path;
+}
+
+/* Forgets a command whose cached path no longer works.  */
+void path_forget(const char *name) {
+  path_entry **link;
+
+  if (!bucket_count)
+    return;
+  for (link = &buckets[name_hash(name)]; *link; link = &(*link)->next)
+    if (strcmp((*link)->name, name) == 0) {
+      path_entry *e = *link;
+      *link = e->next;
+      free(e->path);
+      free(e);
+      entry_count--;
+      return;
+    }
+}
+
+/* hash [-r] [name ...]: lists, empties or fills the table.  */
+int hash_command(int argc, char **argv) {
+  int i, result = 0, listed = 0;
+  size_t b;
+
+  for (i = 1; i < argc && strcmp(argv[i], "-r") == 0; i++)
+    path_clear();
+
+  if (i < argc) {
+    for (; i < argc; i++) {
+      path_forget(argv[i]);
+      if (!path_lookup(argv[i])) {
+        fprintf(stderr, "hash: %s: not found\n", argv[i]);
+        result = 1;
+      }
+    }
+    return result;
+  }
+  if (argc > 1)
+    return 0;
+
+  for (b = 0; b < bucket_count; b++) {
+    path_entry *e;
+    for (e = buckets[b]; e; e = e->next) {
+      if (!e->path)
+        continue;
+      if (!listed++)
+        printf("hits\tcommand\n");
+      printf("%4u\t%s\n", e->hits, e->path);
+    }
+  }
+  if (!listed)
+    printf("hash: hash table empty\n");
+  return 0;
+}
@@ -0,0 +1,236 @@
+#include "placement.h"
+
+/*
+ * CPU placement of the pipeline stages.
+ *
+ * The policy set by the `placement` builtin is applied to every job launched
+ * afterwards:
+ *   none    the kernel places the processes (default);
+ *   pack    all the stages share the CPUs of one NUMA node, so the pipes
+ *           between them stay in the caches of one socket. Successive jobs
+ *           take the nodes in turn;
+ *   spread  each stage gets a CPU of its own. The CPUs are handed out node
+ *           by node, so neighbouring stages are on the same socket;
+ *   LIST    taskset-like CPU list (0-3,8) for every stage, or one list per
+ *           stage separated by ':' (the last one is used for the rest).
+ *
+ * The CPUs of each process are chosen when the job is launched and kept in
+ * the job for `jobs -l`. posix_spawn cannot set the affinity of the child,
+ * so the shell switches its own affinity around the launch of each process
+ * and the child inherits it, whether it is spawned or forked.
+ */
+
+enum { PLACEMENT_NONE, PLACEMENT_PACK, PLACEMENT_SPREAD, PLACEMENT_LIST };
+
+static int policy = PLACEMENT_NONE;
+static char *policy_text;                       /* as given to the builtin */
+static cpu_set_t lists[PLACEMENT_LISTS_MAX];    /* for PLACEMENT_LIST */
+static int list_count;
+
+static int topology_ready;
+static cpu_set_t node_cpus[PLACEMENT_NODES_MAX]; /* allowed CPUs per node */
+static int node_count;
+static int cpu_order[CPU_SETSIZE]; /* allowed CPUs, grouped by node */
+static int cpu_count;
+static unsigned next_node;         /* node of the next packed job */
+static unsigned next_cpu;          /* index in cpu_order of the next stage */
+
+static cpu_set_t shell_cpus; /* affinity of the shell during a launch */
+
+/* Parses a CPU list such as "0-3,8,10-11". Returns -1 if it is invalid.  */
+static int parse_cpulist(const char *text, cpu_set_t *set) {
+  char *end;
+  long first, last;
+
+  CPU_ZERO(set);
+  while (*text && *text != '\n') {
+    first = strtol(text, &end, 10);
+    if (end == text || first < 0)
+      return -1;
+    last = first;
+    if (*end == '-') {
+      text = end + 1;
+      last = strtol(text, &end, 10);
+      if (end == text || last < first)
+        return -1;
+    }
+    if (last >= CPU_SETSIZE)
+      return -1;
+    for (; first <= last; first++)
+      CPU_SET(first, set);
+    text = end;
+    if (*text == ',')
+      text++;
+    else if (*text && *text != '\n')
+      return -1;
+  }
+  return 0;
+}
+
+/* Writes a CPU set as a list, like the kernel does. Returns the length.  */
+int format_cpulist(const cpu_set_t *set, char *buffer, size_t size) {
+  size_t length = 0;
+  int cpu, last;
+
+  buffer[0] = '\0';
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, set))
+      continue;
+    for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set);)
+      last++;
+    if (length < size)
+      length += snprintf(buffer + length, size - length,
+                         last > cpu ? "%s%d-%d" : "%s%d", length ? "," : "",
+                         cpu, last);
+    cpu = last;
+  }
+  return length < size ? (int)length : (int)size - 1;
+}
+
+/* Reads the NUMA nodes from sysfs, restricted to the CPUs the shell may
+   use. Without NUMA information, all the CPUs form a single node.  */
+static void load_topology() {
+  cpu_set_t allowed, cpus;
+  char path[64], line[4096];
+  FILE *file;
+  int node, cpu;
+
+  topology_ready = 1;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    CPU_ZERO(&allowed);
+    CPU_SET(0, &allowed);
+  }
+
+  for (node = 0; node < PLACEMENT_NODES_MAX; node++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    file = fopen(path, "re");
+    if (!file)
+      continue;
+    if (fgets(line, sizeof(line), file) && parse_cpulist(line, &cpus) == 0) {
+      CPU_AND(&cpus, &cpus, &allowed);
+      if (CPU_COUNT(&cpus))
+        node_cpus[node_count++] = cpus;
+    }
+    fclose(file);
+  }
+  if (!node_count)
+    node_cpus[node_count++] = allowed;
+
+  for (node = 0; node < node_count; node++)
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &node_cpus[node]))
+        cpu_order[cpu_count++] = cpu;
+}
+
+/* Chooses the CPUs of the processes of a job about to be launched.  */
+void placement_assign(job *j) {
+  process *p;
+  int stage = 0;
+  unsigned node;
+
+  if (policy == PLACEMENT_NONE)
+    return;
+  if (!topology_ready)
+    load_topology();
+
+  j->placement = arena_strndup(j->arena, policy_text, strlen(policy_text));
+  node = next_node++ % node_count;
+  for (p = j->first_process; p; p = p->next, stage++) {
+    p->cpus = arena_alloc(j->arena, sizeof(cpu_set_t));
+    switch (policy) {
+    case PLACEMENT_PACK:
+      *p->cpus = node_cpus[node];
+      break;
+    case PLACEMENT_SPREAD:
+      CPU_ZERO(p->cpus);
+      CPU_SET(cpu_order[next_cpu++ % cpu_count], p->cpus);
+      break;
+    default:
+      *p->cpus = lists[stage < list_count ? stage : list_count - 1];
+      break;
+    }
+  }
+}
+
+/* Gives the shell the CPUs of the process it is about to start, so that the
+   child inherits them.  */
+void placement_enter(process *p) {
+  if (!p->cpus)
+    return;
+  if (sched_getaffinity(0, sizeof(shell_cpus), &shell_cpus) < 0 ||
+      sched_setaffinity(0, sizeof(cpu_set_t), p->cpus) < 0) {
+    perror("sched_setaffinity");
+    p->cpus = NULL;
+  }
+}
+
+/* Restores the affinity of the shell once the process is started.  */
+void placement_leave(process *p) {
+  if (p->cpus)
+    sched_setaffinity(0, sizeof(shell_cpus), &shell_cpus);
+}
+
+/* placement [none|pack|spread|LIST[:LIST...]]: CPU placement of the stages
+   of the next jobs. Without argument, prints it with the topology.  */
+int placement_command(int argc, char **argv) {
+  cpu_set_t allowed, parsed[PLACEMENT_LISTS_MAX];
+  int kind, count = 0;
+  char *text, *list, *copy;
+  char buffer[256];
+
+  if (!topology_ready)
+    load_topology();
+
+  if (argc < 2) {
+    printf("%s (%d node%s, %d cpu%s)\n", policy_text ? policy_text : "none",
+           node_count, node_count > 1 ? "s" : "", cpu_count,
+           cpu_count > 1 ? "s" : "");
+    return 0;
+  }
+
+  text = argv[1];
+  if (strcmp(text, "none") == 0)
+    kind = PLACEMENT_NONE;
+  else if (strcmp(text, "pack") == 0)
+    kind = PLACEMENT_PACK;
+  else if (strcmp(text, "spread") == 0)
+    kind = PLACEMENT_SPREAD;
+  else {
+    kind = PLACEMENT_LIST;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    copy = strdup(text);
+    if (!copy) {
+      perror("placement");
+      return 1;
+    }
+    for (list = strtok(copy, ":"); list; list = strtok(NULL, ":")) {
+      if (count == PLACEMENT_LISTS_MAX || parse_cpulist(list, &parsed[count])) {
+        fprintf(stderr, "placement: %s: invalid cpu list\n", text);
+        free(copy);
+        return 2;
+      }
+      CPU_AND(&parsed[count], &parsed[count], &allowed);
+      if (!CPU_COUNT(&parsed[count])) {
+        format_cpulist(&allowed, buffer, sizeof(buffer));
+        fprintf(stderr, "placement: %s: no usable cpu (allowed: %s)\n", list,
+                buffer);
+        free(copy);
+        return 2;
+      }
+      count++;
+    }
+    free(copy);
+    if (!count) {
+      fprintf(stderr, "placement: %s: invalid cpu list\n", text);
+      return 2;
+    }
+    memcpy(lists, parsed, count * sizeof(cpu_set_t));
+    list_count = count;
+  }
+
+  free(policy_text);
+  policy_text = kind == PLACEMENT_NONE ? NULL : strdup(text);
+  policy = policy_text ? kind : PLACEMENT_NONE;
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include "reaper.h"
+#include "job_table.h"
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+/*
+ * Event-driven reaping of the children.
+ *
+ * SIGCHLD is blocked and delivered through a signalfd watched by an epoll
+ * set. Readline calls our event hook while it waits for a key, so the
+ * background jobs are reaped, and their completion reported, while the user
+ * is typing instead of only before the next prompt.
+ */
+
+static int child_fd = -1; /* signalfd receiving SIGCHLD */
+static int event_fd = -1; /* epoll set polled from readline */
+static sigset_t saved_mask; /* mask restored in the children */
+
+/* Readline hook: reap and report without breaking the line being edited.  */
+static int reaper_event_hook() {
+  if (!reaper_poll(0))
+    return 0;
+
+  update_status();
+  if (job_table_has_notifications()) {
+    rl_clear_visible_line();
+    do_job_notification();
+    rl_forced_update_display();
+  }
+  return 0;
+}
+
+int reaper_init() {
+  struct epoll_event event;
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, &saved_mask) < 0) {
+    perror("sigprocmask");
+    return -1;
+  }
+
+  child_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  event_fd = epoll_create1(EPOLL_CLOEXEC);
+  event.events = EPOLLIN;
+  event.data.fd = child_fd;
+  if (child_fd < 0 || event_fd < 0 ||
+      epoll_ctl(event_fd, EPOLL_CTL_ADD, child_fd, &event) < 0) {
+    /* Fall back on the reaping done before each prompt.  */
+    perror("signalfd/epoll");
+    if (child_fd >= 0)
+      close(child_fd);
+    if (event_fd >= 0)
+      close(event_fd);
+    child_fd = event_fd = -1;
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    return -1;
+  }
+
+  /* Readline never sees EOF on a pipe while an event hook is set.  */
+  if (shell_is_interactive)
+    rl_event_hook = reaper_event_hook;
+  return 0;
+}
+
+/* Called in the children before exec: SIGCHLD must not stay blocked.  */
+void reaper_restore_signals() {
+  if (child_fd >= 0)
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+}
+
+/* Signal mask the children must start with (for posix_spawn).  */
+void reaper_child_mask(sigset_t *mask) {
+  if (child_fd >= 0)
+    *mask = saved_mask;
+  else
+    sigprocmask(SIG_SETMASK, NULL, mask);
+}
+
+/* Waits up to `timeout` ms (-1 = forever) for children to change state.
+   Returns 1 when update_status has something to reap.  */
+int reaper_poll(int timeout) {
+  struct signalfd_siginfo info;
+  struct epoll_event event;
+  int ready;
+
+  if (event_fd < 0)
+    return 0;
+
+  do
+    ready = epoll_wait(event_fd, &event, 1, timeout);
+  while (ready < 0 && errno == EINTR);
+  if (ready <= 0)
+    return 0;
+
+  /* Signals are merged: update_status reaps every child that is ready.  */
+  while (read(child_fd, &info, sizeof(info)) == sizeof(info))
+    ;
+  return 1;
+}
@@ -0,0 +1,211 @@
+#include "scheduler.h"
+#include "job_table.h"
+
+/*
+ * Slots for the background jobs, like make -j.
+ *
+ * At most scheduler_max_jobs background jobs run at the same time. A job
+ * launched with `&` while every slot is taken is registered in the job table,
+ * so it has a number and `jobs` shows it as queued, but its processes are not
+ * started. Its slot is given back when a job completes, and the queued jobs
+ * start in submission order from scheduler_run, which the shell calls
+ * wherever it reaps children.
+ */
+
+int scheduler_max_jobs;
+
+static int running_jobs;     /* background jobs holding a slot */
+static job *deferred_head;   /* queued jobs, oldest first */
+static job *deferred_tail;
+static volatile sig_atomic_t wait_interrupted;
+
+/* Takes a slot for a background job. Returns 0 if the job has to wait: it
+   is then queued and registered, and must not be launched.  */
+int scheduler_submit(job *j) {
+  if (scheduler_max_jobs && running_jobs >= scheduler_max_jobs) {
+    j->deferred = 1;
+    j->deferred_next = NULL;
+    if (deferred_tail)
+      deferred_tail->deferred_next = j;
+    else
+      deferred_head = j;
+    deferred_tail = j;
+    job_table_add(j);
+    if (!shell_batch)
+      fprintf(stderr, "[%d] queued: %s\n", j->id, j->command);
+    return 0;
+  }
+  j->holds_slot = 1;
+  running_jobs++;
+  return 1;
+}
+
+/* Gives back the slot of a job that completed.  */
+void scheduler_release(job *j) {
+  if (!j->holds_slot)
+    return;
+  j->holds_slot = 0;
+  running_jobs--;
+}
+
+static void unqueue(job *j) {
+  job **link = &deferred_head, *last = NULL;
+
+  while (*link != j) {
+    last = *link;
+    link = &(*link)->deferred_next;
+  }
+  *link = j->deferred_next;
+  if (deferred_tail == j)
+    deferred_tail = last;
+  j->deferred = 0;
+  j->deferred_next = NULL;
+}
+
+static void start(job *j, int foreground) {
+  unqueue(j);
+  launch_pipeline(j, foreground);
+  job_table_started(j);
+  format_job_info(j, "launched");
+}
+
+/* Starts queued jobs while there are free slots.  */
+void scheduler_run() {
+  while (deferred_head &&
+         (!scheduler_max_jobs || running_jobs < scheduler_max_jobs)) {
+    job *j = deferred_head;
+    j->holds_slot = 1;
+    running_jobs++;
+    start(j, 0);
+  }
+}
+
+/* fg on a queued job: it starts right away, without a slot.  */
+void scheduler_start_foreground(job *j) {
+  start(j, 1);
+  if (shell_is_interactive)
+    put_job_in_foreground(j, 0);
+  else
+    wait_for_job(j);
+}
+
+int scheduler_pending() { return deferred_head != NULL; }
+
+/* Job designated by %n or by a process id, as for fg.  */
+static job *parse_job(const char *arg) {
+  job *j;
+
+  if (arg[0] == '%')
+    j = find_job_by_number(atoi(arg + 1));
+  else {
+    process *p = process_table_find(atoi(arg));
+    j = p ? p->job : NULL;
+  }
+  if (!j)
+    fprintf(stderr, "wait: %s: no such job\n", arg);
+  return j;
+}
+
+static int job_done(job *j) { return job_is_completed(j) || job_is_stopped(j); }
+
+/* Status of a job for wait: that of its last process.  */
+static int job_status(job *j) {
+  process *p = j->first_process;
+
+  while (p->next)
+    p = p->next;
+  if (p->stopped)
+    return 128 + WSTOPSIG(p->status);
+  if (WIFSIGNALED(p->status))
+    return 128 + WTERMSIG(p->status);
+  return WEXITSTATUS(p->status);
+}
+
+static void interrupt_wait(int signal) {
+  (void)signal;
+  wait_interrupted = 1;
+}
+
+/* Blocks until a child changes state, then lets the queued jobs start.
+   Returns -1 once there is nothing left to wait for or on ^C.  */
+static int reap_one() {
+  struct rusage usage;
+  int status;
+  pid_t pid;
+
+  pid = wait4(WAIT_ANY, &status, WUNTRACED, &usage);
+  if (pid < 0) {
+    if (errno == EINTR && !wait_interrupted)
+      return 0;
+    return -1;
+  }
+  mark_process_status(pid, status, &usage);
+  scheduler_run();
+  return 0;
+}
+
+/* wait [%n|pid ...]: waits for the given jobs, or for every background job
+   including the queued ones. Returns the status of the last one.  */
+int wait_command(int argc, char **argv) {
+  struct sigaction action, saved;
+  int i, result = 0;
+  job *j;
+
+  /* ^C interrupts the wait even though the shell ignores SIGINT.  */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = interrupt_wait;
+  sigemptyset(&action.sa_mask);
+  wait_interrupted = 0;
+  sigaction(SIGINT, &action, &saved);
+
+  scheduler_run();
+  if (argc < 2) {
+    for (;;) {
+      for (j = first_job; j; j = j->next)
+        if (!job_done(j))
+          break;
+      if (!j || reap_one() < 0)
+        break;
+    }
+  } else {
+    for (i = 1; i < argc && !wait_interrupted; i++) {
+      j = parse_job(argv[i]);
+      if (!j) {
+        result = 127;
+        continue;
+      }
+      while (!job_done(j) && reap_one() == 0)
+        ;
+      result = job_done(j) ? job_status(j) : 128 + SIGINT;
+    }
+  }
+
+  sigaction(SIGINT, &saved, NULL);
+  if (wait_interrupted && shell_is_interactive)
+    putchar('\n');
+  return wait_interrupted ? 128 + SIGINT : result;
+}
+
+/* maxjobs [N]: number of background jobs running at once, 0 for no limit.
+   Without argument, prints it.  */
+int maxjobs_command(int argc, char **argv) {
+  char *end;
+  long value;
+
+  if (argc < 2) {
+    if (scheduler_max_jobs)
+      printf("%d (%d running, %s)\n", scheduler_max_jobs, running_jobs,
+             deferred_head ? "jobs queued" : "none queued");
+    else
+      printf("unlimited\n");
+    return 0;
+  }
+  value = strtol(argv[1], &end, 10);
+  if (*end || value < 0) {
+    fprintf(stderr, "maxjobs: %s: invalid number\n", argv[1]);
+    return 2;
+  }
+  scheduler_max_jobs = value;
+  scheduler_run();
+  return 0;
+}
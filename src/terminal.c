@@ -1,34 +1,60 @@
 #include "terminal.h"
+#include "builtins.h"
+#include "job_table.h"
+#include "job_time.h"
+#include "path_cache.h"
+#include "placement.h"
+#include "reaper.h"
+#include "scheduler.h"
+
+#include <spawn.h>
 pid_t shell_pgid;
 struct termios shell_tmodes;
 int shell_terminal;
 int shell_is_interactive;
+int shell_batch;
+int shell_use_spawn = 1;
+int last_status;
+int shell_pipe_size;
 job *first_job = NULL;
 
 void format_job_info(job *j, const char *status) {
+  if (shell_batch)
+    return;
   fprintf(stderr, "%ld (%s): %s\n", (long)j->pgid, status, j->command);
 }
 
-int mark_process_status(pid_t pid, int status) {
+int mark_process_status(pid_t pid, int status, const struct rusage *usage) {
   job *j;
   process *p;
 
   if (pid > 0) {
     /* Update the record for the process.  */
-    for (j = first_job; j; j = j->next)
-      for (p = j->first_process; p; p = p->next)
-        if (p->pid == pid) {
-          p->status = status;
-          if (WIFSTOPPED(status))
-            p->stopped = 1;
-          else {
-            p->completed = 1;
-            if (WIFSIGNALED(status))
-              fprintf(stderr, "%d: Terminated by signal %d.\n", (int)pid,
-                      WTERMSIG(p->status));
-          }
-          return 0;
+    p = process_table_find(pid);
+    if (p) {
+      j = p->job;
+      p->status = status;
+      if (usage)
+        p->usage = *usage;
+      if (WIFSTOPPED(status)) {
+        p->stopped = 1;
+        job_table_notify(j);
+      } else if (WIFCONTINUED(status)) {
+        p->stopped = 0;
+      } else {
+        if (!p->completed && --j->remaining == 0) {
+          clock_gettime(CLOCK_MONOTONIC, &j->finished);
+          scheduler_release(j);
+          job_table_notify(j);
         }
+        p->completed = 1;
+        p->stopped = 0;
+        if (WIFSIGNALED(status))
+          fprintf(stderr, "%d: Terminated by signal %d.\n", (int)pid,
+                  WTERMSIG(p->status));
+      }
+      return 0;
+    }
     fprintf(stderr, "No child process %d.\n", pid);
     return -1;
   }
@@ -51,22 +77,45 @@ int job_is_stopped(job *j) {
       return 0;
   return 1;
 }
-int job_is_completed(job *j) {
-  process *p;
-
-  for (p = j->first_process; p; p = p->next)
-    if (!p->completed)
-      return 0;
-  return 1;
+int job_is_completed(job *j) { return j->remaining == 0; }
+
+/* Sets last_status from the last process of a job, like $? in sh.  */
+static void record_status(job *j) {
+  process *p = j->first_process;
+
+  while (p->next)
+    p = p->next;
+  if (p->stopped)
+    last_status = 128 + WSTOPSIG(p->status);
+  else if (!p->completed)
+    return;
+  else if (WIFSIGNALED(p->status))
+    last_status = 128 + WTERMSIG(p->status);
+  else
+    last_status = WEXITSTATUS(p->status);
 }
 
 void wait_for_job(job *j) {
+  struct rusage usage;
   int status;
   pid_t pid;
+  process *p = j->first_process;
+
+  /* Only wait for the processes of this job: the other jobs are left to the
+     reaper, which reports them when they finish.  */
+  while (!job_is_stopped(j) && !job_is_completed(j)) {
+    if (j->pgid > 0)
+      pid = wait4(-j->pgid, &status, WUNTRACED, &usage);
+    else {
+      /* No process group (non-interactive shell): one process at a time */
+      while (p->completed)
+        p = p->next;
+      pid = wait4(p->pid, &status, WUNTRACED, &usage);
+    }
 
-  do {
-    pid = waitpid(WAIT_ANY, &status, WUNTRACED);
     if (pid == -1) {
+      if (errno == EINTR)
+        continue;
       if (errno == ECHILD) {
         fprintf(stderr, "waitpid: No more children\n");
         break;
@@ -74,8 +123,21 @@ void wait_for_job(job *j) {
       perror("waitpid");
       break;
     }
-  } while (!mark_process_status(pid, status) && !job_is_stopped(j) &&
-           !job_is_completed(j));
+    if (mark_process_status(pid, status, &usage))
+      break;
+    /* A background job may have freed a slot.  */
+    scheduler_run();
+  }
+  record_status(j);
+}
+
+/* Marks a stopped job as running again before it gets SIGCONT.  */
+static void mark_job_as_running(job *j) {
+  process *p;
+
+  for (p = j->first_process; p; p = p->next)
+    p->stopped = 0;
+  j->notified = 0;
 }
 
 void put_job_in_foreground(job *j, int cont) {
@@ -90,6 +152,7 @@ void put_job_in_foreground(job *j, int cont) {
       fprintf(stderr, "Foreground control given to PGID %d\n", j->pgid);
     }
 
+    mark_job_as_running(j);
     if (kill(-j->pgid, SIGCONT) < 0)
       perror("kill (SIGCONT)");
   }
@@ -111,15 +174,17 @@ void put_job_in_foreground(job *j, int cont) {
 
 void put_job_in_background(job *j, int cont) {
   /* Send the job a continue signal, if necessary.  */
-  if (cont)
+  if (cont) {
+    mark_job_as_running(j);
     if (kill(-j->pgid, SIGCONT) < 0)
       perror("kill (SIGCONT)");
+  }
 }
 
 void init_shell() {
   /* See if we are running interactively.  */
   shell_terminal = STDIN_FILENO;
-  shell_is_interactive = isatty(shell_terminal);
+  shell_is_interactive = !shell_batch && isatty(shell_terminal);
   if (shell_is_interactive) {
     /* Loop until we are in the foreground.  */
     while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp()))
@@ -146,6 +211,17 @@ void init_shell() {
     /* Save default terminal attributes for shell.  */
     tcgetattr(shell_terminal, &shell_tmodes);
   }
+
+  builtins_init();
+
+  /* Reap the children as soon as they exit, even while the user types.
+     Batch mode reaps between commands and starts faster without it.  */
+  if (shell_is_interactive)
+    reaper_init();
+
+  /* MAEL_SHELL_FORK=1 forces the fork() path, e.g. to compare both.  */
+  if (getenv("MAEL_SHELL_FORK"))
+    shell_use_spawn = 0;
 }
 
 void launch_process(process *p, pid_t pgid, int infile, int outfile,
@@ -174,6 +250,7 @@ void launch_process(process *p, pid_t pgid, int infile, int outfile,
     signal(SIGTTOU, SIG_DFL);
     signal(SIGCHLD, SIG_DFL);
   }
+  reaper_restore_signals();
 
   /* Set the standard input/output channels of the new process.  */
   if (infile != STDIN_FILENO) {
@@ -191,11 +268,14 @@ void launch_process(process *p, pid_t pgid, int infile, int outfile,
 
   /* Exec the new process.  Make sure we exit.  */
 
-  if (strncmp(p->argv[0], "cp", 2) == 0) {
-    printf("réussi\n");
-    printf("%s\n", p->argv[1]);
-    printf("%s\n", p->argv[2]);
-    copyDirectory(p->argv[1], p->argv[2]);
+  const builtin *b = builtin_find(p->argv[0]);
+  if (b) {
+    exit(b->run(p->taille, p->argv));
+  } else if (p->path) {
+    execv(p->path, p->argv);
+    /* The cached path went stale: search PATH again.  */
+    if (errno == ENOENT)
+      execvp(p->argv[0], p->argv);
   } else {
     execvp(p->argv[0], p->argv);
   }
@@ -204,41 +284,185 @@ void launch_process(process *p, pid_t pgid, int infile, int outfile,
   exit(1);
 }
 
-void launch_job(job *j, int foreground) {
+/* Builtins that run in the forked child instead of being exec'd.  */
+static int runs_in_child(process *p) { return builtin_find(p->argv[0]) != NULL; }
+
+/* Finds the program of a process through the PATH cache, so that the child
+   does not search PATH itself. Returns 0 if there is no such command.  */
+static int resolve_command(job *j, process *p) {
+  const char *path;
+
+  if (runs_in_child(p))
+    return 1;
+  path = path_lookup(p->argv[0]);
+  if (!path) {
+    fprintf(stderr, "%s: command not found\n", p->argv[0]);
+    return 0;
+  }
+  p->path = arena_strndup(j->arena, path, strlen(path));
+  return 1;
+}
+
+/* Tells whether a process can be started with posix_spawn: builtins that run
+   in the child (cp, xargs, or any builtin in a pipeline) need a real fork.  */
+static int can_spawn(process *p, int foreground) {
+  if (!shell_use_spawn || runs_in_child(p))
+    return 0;
+#if !__GLIBC_PREREQ(2, 35)
+  /* The child could read the terminal before the shell hands it over.  */
+  if (shell_is_interactive && foreground)
+    return 0;
+#endif
+  (void)foreground;
+  return 1;
+}
+
+/* Starts a process without duplicating the shell: posix_spawn uses
+   clone(CLONE_VM | CLONE_VFORK), so its cost does not grow with the memory of
+   the shell. Process group, signal dispositions and redirections are set up
+   the same way as launch_process does. Returns -1 if the process could not
+   be started.  */
+static pid_t spawn_process(process *p, pid_t pgid, int infile, int outfile,
+                           int errfile, int foreground) {
+  posix_spawnattr_t attributes;
+  posix_spawn_file_actions_t actions;
+  short flags = POSIX_SPAWN_SETSIGMASK;
+  sigset_t signals;
+  const char *path;
+  pid_t pid;
+  int error;
+
+  posix_spawnattr_init(&attributes);
+  posix_spawn_file_actions_init(&actions);
+
+  if (shell_is_interactive) {
+    /* Process group (0 = the child leads a new one) and terminal.  */
+    flags |= POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setpgroup(&attributes, pgid);
+#if __GLIBC_PREREQ(2, 35)
+    if (foreground)
+      posix_spawn_file_actions_addtcsetpgrp_np(&actions, shell_terminal);
+#endif
+
+    /* Set the handling for job control signals back to the default.  */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGTSTP);
+    sigaddset(&signals, SIGTTIN);
+    sigaddset(&signals, SIGTTOU);
+    sigaddset(&signals, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+  }
+  (void)foreground;
+  reaper_child_mask(&signals);
+  posix_spawnattr_setsigmask(&attributes, &signals);
+  posix_spawnattr_setflags(&attributes, flags);
+
+  /* Set the standard input/output channels of the new process.  */
+  if (infile != STDIN_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, infile, STDIN_FILENO);
+  if (outfile != STDOUT_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, outfile, STDOUT_FILENO);
+  if (errfile != STDERR_FILENO)
+    posix_spawn_file_actions_adddup2(&actions, errfile, STDERR_FILENO);
+  if (infile > STDERR_FILENO)
+    posix_spawn_file_actions_addclose(&actions, infile);
+  if (outfile > STDERR_FILENO && outfile != infile)
+    posix_spawn_file_actions_addclose(&actions, outfile);
+  if (errfile > STDERR_FILENO && errfile != infile && errfile != outfile)
+    posix_spawn_file_actions_addclose(&actions, errfile);
+
+  if (!p->path)
+    error = posix_spawnp(&pid, p->argv[0], &actions, &attributes, p->argv,
+                         environ);
+  else {
+    error = posix_spawn(&pid, p->path, &actions, &attributes, p->argv,
+                        environ);
+    if (error == ENOENT) {
+      /* The cached path went stale: search PATH again.  */
+      path_forget(p->argv[0]);
+      path = path_lookup(p->argv[0]);
+      if (path)
+        error = posix_spawn(&pid, path, &actions, &attributes, p->argv,
+                            environ);
+    }
+  }
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+
+  if (error) {
+    fprintf(stderr, "%s: %s\n", p->argv[0], strerror(error));
+    return -1;
+  }
+  return pid;
+}
+
+/* Starts the processes of a job, connected by pipes. The job is neither
+   registered nor waited for: that is up to the caller.  */
+void launch_pipeline(job *j, int foreground) {
   process *p;
   pid_t pid;
   int mypipe[2], infile, outfile;
 
+  clock_gettime(CLOCK_MONOTONIC, &j->started);
+  placement_assign(j);
   infile = j->stdin;
   for (p = j->first_process; p; p = p->next) {
-    /* Set up pipes, if necessary.  */
+    /* Set up pipes, if necessary. They are closed on exec, so a stage does
+       not keep the read end of its own output open.  */
     if (p->next) {
-      if (pipe(mypipe) < 0) {
+      if (pipe2(mypipe, O_CLOEXEC) < 0) {
         perror("pipe");
         exit(1);
       }
+      /* Bigger pipes mean fewer context switches between the stages.  */
+      if (shell_pipe_size)
+        fcntl(mypipe[1], F_SETPIPE_SZ, shell_pipe_size);
       outfile = mypipe[1];
     } else
       outfile = j->stdout;
 
-    /* Fork the child processes.  */
-    pid = fork();
-    if (pid == 0)
-      /* This is the child process.  */
-      launch_process(p, j->pgid, infile, outfile, j->stderr, foreground);
-    else if (pid < 0) {
-      /* The fork failed.  */
-      perror("fork");
-      exit(1);
-    } else {
-      /* This is the parent process.  */
-      p->pid = pid;
-      if (shell_is_interactive) {
-        if (!j->pgid)
+    /* The child inherits the CPUs chosen for it.  */
+    placement_enter(p);
+    if (!resolve_command(j, p)) {
+      /* Nothing to start: report it like a failed exec.  */
+      p->completed = 1;
+      p->status = 127 << 8;
+    } else if (can_spawn(p, foreground)) {
+      /* Fast path: the child is set up by posix_spawn.  */
+      pid = spawn_process(p, j->pgid, infile, outfile, j->stderr, foreground);
+      if (pid < 0) {
+        /* Nothing to wait for: report it like a failed exec.  */
+        p->completed = 1;
+        p->status = 127 << 8;
+      } else {
+        p->pid = pid;
+        if (shell_is_interactive && !j->pgid)
           j->pgid = pid;
-        setpgid(pid, j->pgid);
+      }
+    } else {
+      /* Fork the child processes.  */
+      pid = fork();
+      if (pid == 0)
+        /* This is the child process.  */
+        launch_process(p, j->pgid, infile, outfile, j->stderr, foreground);
+      else if (pid < 0) {
+        /* The fork failed.  */
+        perror("fork");
+        exit(1);
+      } else {
+        /* This is the parent process.  */
+        p->pid = pid;
+        if (shell_is_interactive) {
+          if (!j->pgid)
+            j->pgid = pid;
+          setpgid(pid, j->pgid);
+        }
       }
     }
+    placement_leave(p);
 
     /* Clean up after pipes.  */
     if (infile != j->stdin)
@@ -247,78 +471,136 @@ void launch_job(job *j, int foreground) {
       close(outfile);
     infile = mypipe[0];
   }
+  job_close_redirections(j);
+}
+
+void launch_job(job *j, int foreground) {
+  /* Background jobs wait for a slot when the limit is reached.  */
+  if (!foreground && !scheduler_submit(j))
+    return;
 
-  /* Add job to the job list */
-  j->next = first_job;
-  first_job = j;
+  launch_pipeline(j, foreground);
+
+  /* Add job to the job table */
+  job_table_add(j);
 
   format_job_info(j, "launched");
 
-  if (!shell_is_interactive)
-    wait_for_job(j);
-  else if (foreground)
+  if (!shell_is_interactive) {
+    /* No job control: background jobs are reaped between commands.  */
+    if (foreground)
+      wait_for_job(j);
+  } else if (foreground)
     put_job_in_foreground(j, 0);
   else
     put_job_in_background(j, 0);
+
+  /* A timed job is reported when it completes, unless it stopped.  */
+  if (foreground && j->timed && job_is_completed(j)) {
+    job_print_times(j);
+    j->timed = 0;
+  }
 }
 
-void check_jobs_status() {
-  job *j, *jlast, *jnext;
-  process *p;
+/* Closes the files opened for the redirections of a job. The children have
+   their own copies once launched.  */
+void job_close_redirections(job *j) {
+  if (j->stdin != STDIN_FILENO)
+    close(j->stdin);
+  if (j->stdout != STDOUT_FILENO)
+    close(j->stdout);
+  if (j->stderr != STDERR_FILENO && j->stderr != j->stdout)
+    close(j->stderr);
+  j->stdin = STDIN_FILENO;
+  j->stdout = STDOUT_FILENO;
+  j->stderr = STDERR_FILENO;
+}
+
+/* The job, its processes and their arguments all live in the job's arena.  */
+void free_job(job *j) {
+  job_close_redirections(j);
+  arena_destroy(j->arena);
+}
+
+/* Reaps every child that changed state, without blocking.  */
+void update_status() {
+  struct rusage usage;
   pid_t pid;
   int status;
 
-  /* Update status information for child processes */
   do {
-    pid = waitpid(WAIT_ANY, &status, WUNTRACED | WNOHANG);
-  } while (!mark_process_status(pid, status) && pid > 0);
+    pid = wait4(WAIT_ANY, &status, WUNTRACED | WNOHANG, &usage);
+  } while (!mark_process_status(pid, status, &usage) && pid > 0);
+}
+
+/* Reports the jobs that completed or stopped since the last call.  */
+void do_job_notification() {
+  job *j;
 
-  /* Check for completed jobs */
-  jlast = NULL;
-  for (j = first_job; j; j = jnext) {
-    jnext = j->next;
+  /* Start the queued jobs the completed ones made room for.  */
+  scheduler_run();
 
+  while ((j = job_table_next_notification())) {
     if (job_is_completed(j)) {
-      if (jlast)
-        jlast->next = jnext;
-      else
-        first_job = jnext;
-
+      if (j->timed)
+        job_print_times(j);
       format_job_info(j, "completed");
 
       /* Free memory associated with the job */
-      for (p = j->first_process; p; p = p->next) {
-        int i;
-        for (i = 0; i < p->taille; i++)
-          free(p->argv[i]);
-        free(p->argv);
-      }
-      free(j->command);
-      free(j);
+      job_table_remove(j);
+      free_job(j);
     } else if (job_is_stopped(j) && !j->notified) {
       format_job_info(j, "stopped");
       j->notified = 1;
-      jlast = j;
-    } else
-      jlast = j;
+    }
   }
 }
 
-void list_jobs() {
+void check_jobs_status() {
+  /* Update status information for child processes */
+  update_status();
+
+  /* Report the jobs that completed or stopped since the last check */
+  do_job_notification();
+}
+
+/* Lists the jobs. With `verbose` (jobs -l), also shows the CPU time used by
+   each job and each of its processes, and where they were placed.  */
+void list_jobs(int verbose) {
+  char cpus[256];
   job *j;
-  int job_num = 1;
+  process *p;
 
   for (j = first_job; j; j = j->next) {
-    printf("[%d] %6d ", job_num++, j->pgid);
+    printf("[%d] %6d ", j->id, j->pgid);
 
-    if (job_is_completed(j))
+    if (j->deferred)
+      printf("Queued   ");
+    else if (job_is_completed(j))
       printf("Completed");
     else if (job_is_stopped(j))
       printf("Stopped  ");
     else
       printf("Running  ");
 
+    if (verbose)
+      printf(" cpu %.2fs", job_cpu_seconds(j));
+    if (verbose && j->placement)
+      printf(" placement %s", j->placement);
     printf("\t%s\n", j->command);
+
+    if (!verbose)
+      continue;
+    for (p = j->first_process; p; p = p->next) {
+      printf("    %6d %-9s cpu %.2fs", (int)p->pid,
+             p->completed ? "Done" : p->stopped ? "Stopped" : "Running",
+             process_cpu_seconds(p));
+      if (p->cpus) {
+        format_cpulist(p->cpus, cpus, sizeof(cpus));
+        printf(" on %s", cpus);
+      }
+      printf("\t%s\n", p->argv[0]);
+    }
   }
 
   if (!first_job) {
@@ -326,29 +608,14 @@ void list_jobs() {
   }
 }
 
-// Returns the job corresponding to the (1-based index)
-job *find_job_by_number(int job_num) {
-  job *j;
-  int i = 1;
-
-  for (j = first_job; j; j = j->next, i++) {
-    if (i == job_num) {
-      return j;
-    }
-  }
-
-  return NULL;
-}
+// Returns the job corresponding to the job number shown by `jobs`
+job *find_job_by_number(int job_num) { return job_table_find(job_num); }
 
 job *find_job_by_pid(pid_t pid) {
-  job *j;
-
-  for (j = first_job; j; j = j->next) {
-    if (j->pgid == pid) {
-      return j;
-    }
-  }
+  process *p = process_table_find(pid);
 
+  if (p && p->job->pgid == pid)
+    return p->job;
   return NULL;
 }
 
@@ -391,6 +658,12 @@ void do_fg(char *arg) {
     }
   }
 
+  // A queued job starts right away
+  if (j->deferred) {
+    scheduler_start_foreground(j);
+    return;
+  }
+
   // Continue the job if it was stopped
   if (job_is_stopped(j)) {
     printf("Continuing %s\n", j->command);
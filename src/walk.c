@@ -0,0 +1,369 @@
+#include "walk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Iterative tree walk.
+ *
+ * The walk keeps an explicit stack of the directories being read instead of
+ * recursing, and every entry is opened or stat'ed relative to the descriptor
+ * of its directory (openat, fstatat), so paths can be as long as the tree is
+ * deep: the path handed to the callbacks lives in a buffer that grows, and
+ * is only meant for messages. The type given by readdir is trusted, so a
+ * regular file is not stat'ed at all unless WALK_STAT asks for it.
+ *
+ * Only the WALK_OPEN_MAX deepest directories of the stack stay open. An
+ * older one is parked: its position is saved with telldir and it is closed,
+ * then reopened through ".." of its child when the walk comes back to it,
+ * after checking that it is still the same directory. The ".." of a
+ * directory entered through a symbolic link is not the directory below it on
+ * the stack, so that one is never parked.
+ */
+
+/* A directory of the stack. */
+typedef struct walkFrame {
+  DIR *directory;    /* NULL while parked */
+  long position;     /* where to resume a parked directory */
+  struct stat stat;  /* to recognize the directory when it is reopened */
+  size_t pathLength; /* length of its path */
+  size_t nameOffset; /* where its name starts in the path */
+  int viaLink;       /* entered through a symbolic link */
+} walkFrame;
+
+typedef struct walker {
+  int flags;
+  walkCallback callback;
+  void *context;
+  char *path;
+  size_t pathLength;
+  size_t pathCapacity;
+  walkFrame *frames;
+  size_t depth; /* frames in use */
+  size_t capacity;
+} walker;
+
+/**
+ * Replaces the end of the path, after `length` bytes, with "/name".
+ */
+static int appendName(walker *w, size_t length, const char *name) {
+  size_t nameLength = strlen(name);
+  size_t needed = length + nameLength + 2;
+
+  if (needed > w->pathCapacity) {
+    size_t capacity = w->pathCapacity * 2;
+    while (capacity < needed)
+      capacity *= 2;
+    char *path = realloc(w->path, capacity);
+    if (!path)
+      return -1;
+    w->path = path;
+    w->pathCapacity = capacity;
+  }
+  w->path[length] = '/';
+  memcpy(w->path + length + 1, name, nameLength + 1);
+  w->pathLength = length + nameLength + 1;
+  return 0;
+}
+
+static void truncatePath(walker *w, size_t length) {
+  w->path[length] = '\0';
+  w->pathLength = length;
+}
+
+/* Descriptor of the directory that contains frame `index`. */
+static int parentDescriptor(const walker *w, size_t index) {
+  if (index == 0)
+    return AT_FDCWD;
+  return w->frames[index - 1].directory
+             ? dirfd(w->frames[index - 1].directory)
+             : -1;
+}
+
+static walkAction report(walker *w, walkEvent event, const char *name,
+                         int parent, int fd, size_t depth, unsigned char type,
+                         const struct stat *stat, int error) {
+  walkEntry entry = {.event = event,
+                     .path = w->path,
+                     .name = name,
+                     .parent = parent,
+                     .fd = fd,
+                     .depth = depth,
+                     .type = type,
+                     .stat = stat,
+                     .error = error};
+
+  return w->callback(&entry, w->context);
+}
+
+/**
+ * Pushes a directory opened as `fd`, parking the oldest open directory if
+ * there are too many. On failure, the caller still owns `fd`.
+ */
+static int pushFrame(walker *w, int fd, const struct stat *stat,
+                     size_t nameOffset, int viaLink) {
+  if (w->depth == w->capacity) {
+    size_t capacity = w->capacity ? w->capacity * 2 : WALK_STACK_MIN;
+    walkFrame *frames = realloc(w->frames, capacity * sizeof(walkFrame));
+    if (!frames)
+      return -1;
+    w->frames = frames;
+    w->capacity = capacity;
+  }
+
+  DIR *directory = fdopendir(fd);
+  if (!directory)
+    return -1;
+
+  // A sibling of a directory that was left may have parked it already, and
+  // it can't be reopened from a child entered through a link
+  size_t oldestIndex = w->depth - WALK_OPEN_MAX;
+  if (w->depth >= WALK_OPEN_MAX && w->frames[oldestIndex].directory &&
+      !(oldestIndex + 1 < w->depth ? w->frames[oldestIndex + 1].viaLink
+                                   : viaLink)) {
+    walkFrame *oldest = &w->frames[oldestIndex];
+    oldest->position = telldir(oldest->directory);
+    closedir(oldest->directory);
+    oldest->directory = NULL;
+  }
+
+  walkFrame *frame = &w->frames[w->depth++];
+  frame->directory = directory;
+  frame->stat = *stat;
+  frame->pathLength = w->pathLength;
+  frame->nameOffset = nameOffset;
+  frame->viaLink = viaLink;
+  return 0;
+}
+
+/**
+ * Reopens a parked directory through ".." of its child `child`, and resumes
+ * the reading where it stopped.
+ */
+static int unparkFrame(walkFrame *frame, int child) {
+  struct stat stat;
+  int fd = openat(child, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (fd == -1)
+    return -1;
+  // The directory may have been moved away meanwhile
+  if (fstat(fd, &stat) == -1 || stat.st_dev != frame->stat.st_dev ||
+      stat.st_ino != frame->stat.st_ino) {
+    close(fd);
+    errno = ENOENT;
+    return -1;
+  }
+  frame->directory = fdopendir(fd);
+  if (!frame->directory) {
+    close(fd);
+    return -1;
+  }
+  seekdir(frame->directory, frame->position);
+  return 0;
+}
+
+/**
+ * Pops the directory at the top of the stack once all its entries were
+ * walked, and tells the callback.
+ */
+static walkAction leaveDirectory(walker *w) {
+  size_t index = w->depth - 1;
+  walkFrame *frame = &w->frames[index];
+  int fd = dirfd(frame->directory);
+  walkAction action;
+
+  truncatePath(w, frame->pathLength);
+  if (index > 0 && !w->frames[index - 1].directory &&
+      unparkFrame(&w->frames[index - 1], fd) == -1) {
+    // Without its parent, the rest of the tree can't be reached
+    report(w, WALK_ERROR, w->path + frame->nameOffset, -1, fd, index, DT_DIR,
+           &frame->stat, errno);
+    action = WALK_STOP;
+  } else {
+    action = report(w, WALK_DIRECTORY_END, w->path + frame->nameOffset,
+                    parentDescriptor(w, index), fd, index, DT_DIR,
+                    &frame->stat, 0);
+  }
+
+  closedir(frame->directory);
+  w->depth--;
+  return action == WALK_STOP ? WALK_STOP : WALK_CONTINUE;
+}
+
+/**
+ * Tells whether a directory is already on the stack. Each lookup crosses a
+ * single symbolic link, so the kernel never sees a loop: a followed link to
+ * an ancestor would be walked forever.
+ */
+static int isAncestor(const walker *w, const struct stat *stat) {
+  for (size_t i = 0; i < w->depth; i++)
+    if (w->frames[i].stat.st_dev == stat->st_dev &&
+        w->frames[i].stat.st_ino == stat->st_ino)
+      return 1;
+  return 0;
+}
+
+static int isLink(int parent, const char *name) {
+  struct stat stat;
+
+  return fstatat(parent, name, &stat, AT_SYMLINK_NOFOLLOW) == 0 &&
+         S_ISLNK(stat.st_mode);
+}
+
+/**
+ * Hands an entry of the directory at the top of the stack to the callback,
+ * and pushes it if it is a directory to walk.
+ */
+static walkAction visitEntry(walker *w, const struct dirent *dirent) {
+  size_t depth = w->depth;
+  size_t nameOffset = w->frames[depth - 1].pathLength + 1;
+  int parent = dirfd(w->frames[depth - 1].directory);
+  const char *name = w->path + nameOffset;
+  int follow = w->flags & WALK_FOLLOW;
+  unsigned char type = dirent->d_type;
+  struct stat stat;
+  const struct stat *known = NULL;
+  int viaLink = 0;
+
+  // d_type is enough unless a link has to be followed
+  if ((w->flags & WALK_STAT) || type == DT_UNKNOWN ||
+      (type == DT_LNK && follow)) {
+    if (fstatat(parent, name, &stat, follow ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+      return report(w, WALK_ERROR, name, parent, -1, depth, type, NULL,
+                    errno);
+    // Without d_type, a followed directory may still be a link
+    viaLink = follow && (type == DT_LNK ||
+                         (type == DT_UNKNOWN && S_ISDIR(stat.st_mode) &&
+                          isLink(parent, name)));
+    type = IFTODT(stat.st_mode);
+    known = &stat;
+  }
+
+  if (type != DT_DIR)
+    return report(w, WALK_FILE, name, parent, -1, depth, type, known, 0);
+
+  int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+                                    (follow ? 0 : O_NOFOLLOW));
+  int error = 0;
+  if (fd == -1 || fstat(fd, &stat) == -1)
+    error = errno;
+  else if (follow && isAncestor(w, &stat))
+    error = ELOOP;
+  else if (pushFrame(w, fd, &stat, nameOffset, viaLink) == -1)
+    error = errno;
+  if (error) {
+    if (fd != -1)
+      close(fd);
+    return report(w, WALK_ERROR, name, parent, -1, depth, DT_DIR, NULL,
+                  error);
+  }
+
+  walkAction action = report(w, WALK_DIRECTORY, name, parent, fd, depth,
+                             DT_DIR, &stat, 0);
+  if (action != WALK_CONTINUE) {
+    // Not entered: drop it without WALK_DIRECTORY_END
+    closedir(w->frames[--w->depth].directory);
+    truncatePath(w, nameOffset - 1);
+  }
+  return action == WALK_STOP ? WALK_STOP : WALK_CONTINUE;
+}
+
+/**
+ * Walks the tree below `root`, depth first, calling `callback` for every
+ * entry (see walkEvent). A root that is not a directory is reported as a
+ * single WALK_FILE. Errors on entries are reported to the callback and the
+ * walk goes on. Returns 0 when the whole tree was walked, -1 when the walk
+ * was stopped: by the callback, for lack of memory, or because the root
+ * can't be read.
+ */
+int walkTree(const char *root, int flags, walkCallback callback,
+             void *context) {
+  walker w = {.flags = flags, .callback = callback, .context = context};
+  struct stat rootStat;
+  walkAction action = WALK_CONTINUE;
+
+  w.pathLength = strlen(root);
+  w.pathCapacity = WALK_PATH_MIN;
+  while (w.pathCapacity <= w.pathLength)
+    w.pathCapacity *= 2;
+  w.path = malloc(w.pathCapacity);
+  if (!w.path)
+    return -1;
+  memcpy(w.path, root, w.pathLength + 1);
+
+  if (((flags & WALK_FOLLOW) ? stat(root, &rootStat)
+                             : lstat(root, &rootStat)) == -1) {
+    report(&w, WALK_ERROR, root, AT_FDCWD, -1, 0, DT_UNKNOWN, NULL, errno);
+    free(w.path);
+    return -1;
+  }
+
+  if (!S_ISDIR(rootStat.st_mode)) {
+    action = report(&w, WALK_FILE, root, AT_FDCWD, -1, 0,
+                    IFTODT(rootStat.st_mode), &rootStat, 0);
+    free(w.path);
+    return action == WALK_STOP ? -1 : 0;
+  }
+
+  int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1 || pushFrame(&w, fd, &rootStat, 0, 0) == -1) {
+    report(&w, WALK_ERROR, root, AT_FDCWD, -1, 0, DT_DIR, NULL, errno);
+    if (fd != -1)
+      close(fd);
+    free(w.frames);
+    free(w.path);
+    return -1;
+  }
+  action = report(&w, WALK_DIRECTORY, root, AT_FDCWD, fd, 0, DT_DIR,
+                  &rootStat, 0);
+  if (action != WALK_CONTINUE) {
+    closedir(w.frames[--w.depth].directory);
+    free(w.frames);
+    free(w.path);
+    return action == WALK_STOP ? -1 : 0;
+  }
+
+  while (w.depth > 0 && action != WALK_STOP) {
+    walkFrame *frame = &w.frames[w.depth - 1];
+    struct dirent *dirent;
+
+    errno = 0;
+    dirent = readdir(frame->directory);
+    if (!dirent) {
+      // A directory that can't be read to the end is still left
+      if (errno)
+        report(&w, WALK_ERROR, w.path + frame->nameOffset,
+               parentDescriptor(&w, w.depth - 1), dirfd(frame->directory),
+               w.depth - 1, DT_DIR, &frame->stat, errno);
+      action = leaveDirectory(&w);
+      continue;
+    }
+
+    // Skip the "." and ".." entries
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+      continue;
+
+    if (appendName(&w, frame->pathLength, dirent->d_name) == -1) {
+      action = WALK_STOP;
+      break;
+    }
+    // A directory that was entered keeps its name in the path
+    size_t depth = w.depth;
+    action = visitEntry(&w, dirent);
+    if (w.depth == depth)
+      truncatePath(&w, w.frames[depth - 1].pathLength);
+  }
+
+  // Stopped early: close what is still open
+  while (w.depth > 0) {
+    walkFrame *frame = &w.frames[--w.depth];
+    if (frame->directory)
+      closedir(frame->directory);
+  }
+  free(w.frames);
+  free(w.path);
+  return action == WALK_STOP ? -1 : 0;
+}
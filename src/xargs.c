@@ -0,0 +1,316 @@
+#include "xargs.h"
+#include "parse.h"
+
+/*
+ * Built-in xargs.
+ *
+ * It runs in the forked child of its pipeline stage, like cp. The whole input
+ * is read and split in place, then cut into batches that fit in ARG_MAX, and
+ * each batch is started with launch_pipeline, at most -P at a time. Job
+ * control is off in this process, so the batches stay in the process group
+ * of the stage and ^C or ^Z reach them too.
+ */
+
+/* Reads the whole standard input into a NUL-terminated buffer.  */
+static char *read_input(size_t *size) {
+  size_t capacity = XARGS_READ, used = 0;
+  char *buffer = malloc(capacity + 1);
+  ssize_t n;
+
+  while (buffer) {
+    if (used == capacity) {
+      char *grown = realloc(buffer, capacity * 2 + 1);
+      if (!grown)
+        break;
+      buffer = grown;
+      capacity *= 2;
+    }
+    n = read(STDIN_FILENO, buffer + used, capacity - used);
+    if (n == 0) {
+      buffer[used] = '\0';
+      *size = used;
+      return buffer;
+    }
+    if (n < 0 && errno != EINTR) {
+      perror("xargs: read");
+      free(buffer);
+      return NULL;
+    }
+    if (n > 0)
+      used += n;
+  }
+  perror("xargs: malloc");
+  free(buffer);
+  return NULL;
+}
+
+/* Splits the input in place. Items are separated by NUL bytes with -0,
+   otherwise by blanks and newlines, with quotes and backslashes handled the
+   same way as xargs does.  */
+static char **split_input(char *input, size_t size, int nul, size_t *count) {
+  size_t capacity = ARGS_MIN, n = 0;
+  char **items = malloc(capacity * sizeof(char *));
+  char *read = input, *end = input + size, *write;
+
+  while (items) {
+    if (nul) {
+      while (read < end && !*read)
+        read++;
+    } else {
+      while (read < end && isspace((unsigned char)*read))
+        read++;
+    }
+    if (read >= end)
+      break;
+
+    if (n == capacity) {
+      char **grown = realloc(items, capacity * 2 * sizeof(char *));
+      if (!grown) {
+        free(items);
+        items = NULL;
+        break;
+      }
+      items = grown;
+      capacity *= 2;
+    }
+    items[n++] = write = read;
+
+    if (nul) {
+      read += strlen(read) + 1;
+      continue;
+    }
+    while (read < end && !isspace((unsigned char)*read)) {
+      char c = *read++;
+      if (c == '\'' || c == '"') {
+        while (read < end && *read != c)
+          *write++ = *read++;
+        if (read == end) {
+          fprintf(stderr, "xargs: unmatched %s quote\n",
+                  c == '"' ? "double" : "single");
+          free(items);
+          return NULL;
+        }
+        read++;
+      } else if (c == '\\' && read < end)
+        *write++ = *read++;
+      else
+        *write++ = c;
+    }
+    /* The separator, if any, has been read: the word can end here.  */
+    *write = '\0';
+    read++;
+  }
+  if (!items)
+    perror("xargs: malloc");
+  *count = n;
+  return items;
+}
+
+/* Room for the arguments of a command: ARG_MAX minus the environment.  */
+static long argument_space() {
+  long space = sysconf(_SC_ARG_MAX);
+  char **env;
+
+  if (space <= 0)
+    space = 128 * 1024;
+  for (env = environ; *env; env++)
+    space -= strlen(*env) + 1 + sizeof(char *);
+  return space - XARGS_HEADROOM;
+}
+
+/* Maps the status of a batch to the exit status of xargs.  */
+static int batch_status(int status) {
+  if (WIFSIGNALED(status))
+    return 125;
+  switch (WEXITSTATUS(status)) {
+  case 0:
+    return 0;
+  case 126:
+  case 127:
+    return WEXITSTATUS(status);
+  case 255:
+    return 124;
+  default:
+    return 123;
+  }
+}
+
+/* Waits for one of the running batches and frees it. Returns its status.  */
+static int wait_batch(job **running, int *count) {
+  int status, i;
+  pid_t pid;
+
+  for (;;) {
+    pid = waitpid(WAIT_ANY, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("xargs: waitpid");
+      return 125;
+    }
+    for (i = 0; i < *count; i++)
+      if (running[i]->first_process->pid == pid)
+        break;
+    if (i == *count)
+      continue;
+
+    free_job(running[i]);
+    running[i] = running[--*count];
+    return batch_status(status);
+  }
+}
+
+/* Starts `command` followed by `items[0..count)` as a new batch.  */
+static job *start_batch(char **command, int command_count, char **items,
+                        size_t count, char ***argv, size_t *capacity) {
+  size_t needed = command_count + count;
+  job *j;
+
+  if (needed > *capacity) {
+    char **grown = realloc(*argv, needed * sizeof(char *));
+    if (!grown)
+      return NULL;
+    *argv = grown;
+    *capacity = needed;
+  }
+  memcpy(*argv, command, command_count * sizeof(char *));
+  memcpy(*argv + command_count, items, count * sizeof(char *));
+
+  j = job_create(command[0], sizeof(process) + (needed + 1) * sizeof(char *));
+  if (!j || !job_add_process(j, *argv, needed)) {
+    if (j)
+      free_job(j);
+    return NULL;
+  }
+  launch_pipeline(j, 0);
+  return j;
+}
+
+int xargs_command(int argc, char **argv) {
+  static char *echo[] = {"echo"};
+  long max_args = 0, parallel = 1;
+  int nul = 0, i, result = 0, running_count = 0, status;
+  char **command, **items, **batch_argv = NULL, *input;
+  size_t command_count, count, first, batch_capacity = 0, size;
+  long space, command_space = 0;
+  job **running;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(argv[i], "-0") == 0) {
+      nul = 1;
+    } else if (argv[i][1] == 'n' || argv[i][1] == 'P') {
+      char option = argv[i][1];
+      const char *value = argv[i][2] ? argv[i] + 2 : argv[++i];
+      if (!value) {
+        fprintf(stderr, "xargs: option -%c needs a number\n", option);
+        return 1;
+      }
+      if (option == 'n')
+        max_args = atol(value);
+      else
+        parallel = atol(value);
+    } else {
+      fprintf(stderr,
+              "usage: xargs [-0] [-n max] [-P jobs] [command [args]]\n");
+      return 1;
+    }
+  }
+
+  if (i < argc) {
+    command = argv + i;
+    command_count = argc - i;
+  } else {
+    command = echo;
+    command_count = 1;
+  }
+  /* -P 0 runs as many batches as possible at the same time.  */
+  if (parallel <= 0 || parallel > XARGS_MAX_JOBS)
+    parallel = XARGS_MAX_JOBS;
+
+  /* The batches get the terminal of the stage, but no job control.  */
+  shell_is_interactive = 0;
+
+  input = read_input(&size);
+  if (!input)
+    return 1;
+  items = split_input(input, size, nul, &count);
+  if (!items) {
+    free(input);
+    return 1;
+  }
+
+  /* Our input is used up: the batches read from /dev/null.  */
+  int null = open("/dev/null", O_RDONLY);
+  if (null >= 0) {
+    dup2(null, STDIN_FILENO);
+    close(null);
+  }
+
+  space = argument_space();
+  for (i = 0; i < (int)command_count; i++)
+    command_space += strlen(command[i]) + 1 + sizeof(char *);
+
+  running = malloc(parallel * sizeof(job *));
+  if (!running) {
+    perror("xargs: malloc");
+    return 1;
+  }
+
+  /* Without input the command still runs once, like GNU xargs.  */
+  for (first = 0; first < count || (count == 0 && first == 0);) {
+    size_t last = first;
+    long used = command_space;
+
+    while (last < count && (!max_args || (long)(last - first) < max_args)) {
+      long cost = strlen(items[last]) + 1 + sizeof(char *);
+      if (used + cost > space)
+        break;
+      used += cost;
+      last++;
+    }
+    if (last == first && count) {
+      fprintf(stderr, "xargs: argument line too long\n");
+      result = 1;
+      break;
+    }
+
+    /* Wait for a free slot.  */
+    if (running_count == parallel) {
+      status = wait_batch(running, &running_count);
+      if (status > result)
+        result = status;
+    }
+
+    job *j = start_batch(command, command_count, items + first, last - first,
+                         &batch_argv, &batch_capacity);
+    if (!j) {
+      perror("xargs: malloc");
+      result = 1;
+      break;
+    }
+    if (j->first_process->completed) {
+      /* It could not be started.  */
+      if (127 > result)
+        result = 127;
+      free_job(j);
+    } else
+      running[running_count++] = j;
+
+    first = last > first ? last : first + 1;
+  }
+
+  while (running_count > 0) {
+    status = wait_batch(running, &running_count);
+    if (status > result)
+      result = status;
+  }
+
+  free(running);
+  free(batch_argv);
+  free(items);
+  free(input);
+  return result;
+}
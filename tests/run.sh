@@ -0,0 +1,101 @@
+#!/bin/sh
+# Regression tests of the shell, run by `make check`.
+#
+#   tests/run.sh <shell>
+#
+# Every case runs the shell on a small tree under a temporary directory and
+# checks its exit status and what it left behind. Prints one line per case
+# and exits non-zero if any of them failed.
+
+set -e
+
+SHELL_BIN=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/mael-tests.XXXXXX")
+trap 'chmod -R u+rwx "$WORK"; rm -rf "$WORK"' EXIT
+FAILED=0
+
+# check <name> <command...>: runs a case in a fresh directory. `set -e` does
+# not apply inside the case, every step must return on failure itself.
+check() {
+  name=$1
+  shift
+  mkdir "$WORK/$name"
+  if (cd "$WORK/$name" && "$@") >"$WORK/$name.log" 2>&1; then
+    echo "ok      $name"
+  else
+    echo "FAILED  $name"
+    sed 's/^/        /' "$WORK/$name.log"
+    FAILED=1
+  fi
+}
+
+# A directory reached through a symbolic link, deeper than WALK_OPEN_MAX:
+# the directories above it are parked and must be found again. Every level
+# has a few more entries, so that some are read after coming back up
+# whatever the order of readdir().
+cp_follow_deep_link() {
+  mkdir real src
+  dir=real
+  for i in $(seq 1 40); do
+    for name in a m z; do
+      echo "$i" >"$dir/$name"
+    done
+    dir=$dir/d$i
+    mkdir "$dir"
+  done
+  ln -s ../real src/link
+  "$SHELL_BIN" -c "cp -q src copy" || return 1
+  diff -r real copy/link || return 1
+}
+
+# A file of an io_uring batch that can't be copied fails the whole copy.
+# root reads anything, so then the target of the file is a directory.
+cp_uring_batch_failure() {
+  mkdir src copy
+  for name in a b c; do
+    echo "$name" >"src/$name"
+  done
+  if [ "$(id -u)" -eq 0 ]; then
+    mkdir copy/b
+  else
+    chmod 000 src/b
+  fi
+  if "$SHELL_BIN" -c "cp -q --backend=uring src copy"; then
+    echo "cp succeeded"
+    return 1
+  fi
+  cmp src/a copy/a && cmp src/c copy/c || return 1
+}
+
+# Builtins that change the shell are refused in a pipeline or in the
+# background, where the change would be lost in a child.
+shell_builtin_in_pipeline() {
+  if "$SHELL_BIN" -c "true | cd /"; then
+    echo "cd in a pipeline succeeded"
+    return 1
+  fi
+  out=$("$SHELL_BIN" -c "exit 3 | cat
+echo still running") || return 1
+  [ "$out" = "still running" ] || return 1
+}
+
+# The default manifest sits next to the target, however long its path is.
+cp_manifest_long_target() {
+  mkdir src
+  echo data >src/f
+  dir=.
+  for i in 1 2 3 4 5 6; do
+    dir=$dir/$(printf "%0200d" "$i")
+  done
+  mkdir -p "$dir"
+  "$SHELL_BIN" -c "cp -q --manifest src $dir/copy" || return 1
+  [ -s "$dir/copy.crc32c" ] || return 1
+}
+
+check cp_follow_deep_link cp_follow_deep_link
+check cp_uring_batch_failure cp_uring_batch_failure
+check shell_builtin_in_pipeline shell_builtin_in_pipeline
+check cp_manifest_long_target cp_manifest_long_target
+
+exit "$FAILED"